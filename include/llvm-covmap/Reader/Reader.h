@@ -0,0 +1,220 @@
+#ifndef LLVM_COVMAP_READER_READER_H
+#define LLVM_COVMAP_READER_READER_H
+
+/*
+ * C interface of libllvm-covmap-reader, a library for tools that analyze coverage bitmaps.
+ *
+ * A reader maps a coverage bitmap read-only, either from a live POSIX shared memory object or from a snapshot file,
+ * and answers queries directly on the mapping without copying the bitmap. If the bitmap holds several per-process
+ * slots, queries operate on the union of all slots unless a slot is given explicitly.
+ *
+ * Functions returning int return 0 on success and a negated errno value on failure, unless documented otherwise.
+ * Readers are not thread-safe; use one reader per thread or serialize the calls.
+ *
+ * This header is included by both C and C++ sources.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "llvm-covmap/Runtime/ModuleRegistry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LLVM_COVMAP_READER_API __attribute__((visibility("default")))
+
+/**
+ * Version of the reader interface. Bumped only on incompatible changes.
+ */
+#define LLVM_COVMAP_READER_VERSION 1
+
+/**
+ * Set operations between the bitmaps of two readers.
+ */
+enum llvm_covmap_set_op {
+  /**
+   * Bits set in either bitmap.
+   */
+  LLVM_COVMAP_SET_UNION = 0,
+
+  /**
+   * Bits set in both bitmaps.
+   */
+  LLVM_COVMAP_SET_INTERSECTION = 1,
+
+  /**
+   * Bits set in the first bitmap but not in the second one.
+   */
+  LLVM_COVMAP_SET_DIFFERENCE = 2,
+};
+
+typedef struct llvm_covmap_reader llvm_covmap_reader;
+
+/**
+ * Callback invoked for every set bit during iteration. Returning nonzero stops the iteration.
+ */
+typedef int (*llvm_covmap_visit_fn)(uint64_t bit, void *context);
+
+/**
+ * Callback invoked for every registered module during iteration. Returning nonzero stops the iteration.
+ */
+typedef int (*llvm_covmap_visit_module_fn)(const struct llvm_covmap_module *module, void *context);
+
+/**
+ * Get the version of the reader interface implemented by the library.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_version(void);
+
+/**
+ * Attach to a live coverage bitmap stored in the given POSIX shared memory object.
+ *
+ * The module registry of the bitmap is attached as well if it exists.
+ *
+ * @param name the name of the shared memory object, as in LLVM_COVMAP_SHM_NAME.
+ * @param slots the number of per-process slots in the bitmap, as in LLVM_COVMAP_FORK_SLOTS. 0 is treated as 1.
+ * @param reader receives the new reader.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_open_shm(const char *name, uint64_t slots, llvm_covmap_reader **reader);
+
+/**
+ * Open a snapshot file written by llvm_covmap_reader_snapshot, or any file holding a raw copy of a coverage bitmap.
+ *
+ * The module registry is read from the file named by the path followed by LLVM_COVMAP_REGISTRY_SUFFIX if it exists.
+ *
+ * @param path the path to the snapshot file.
+ * @param slots the number of per-process slots in the bitmap. 0 is treated as 1.
+ * @param reader receives the new reader.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_open_file(const char *path, uint64_t slots, llvm_covmap_reader **reader);
+
+/**
+ * Close the reader and unmap the bitmap. Passing NULL has no effect.
+ */
+LLVM_COVMAP_READER_API void llvm_covmap_reader_close(llvm_covmap_reader *reader);
+
+/**
+ * Re-map the bitmap if it has been grown by the instrumented program since it was mapped.
+ *
+ * Pointers obtained from llvm_covmap_reader_bitmap and llvm_covmap_reader_registry are invalidated if the bitmap is
+ * re-mapped.
+ *
+ * @return 1 if the bitmap has been re-mapped, 0 if it is unchanged, or a negated errno value on failure.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_reload(llvm_covmap_reader *reader);
+
+/**
+ * Get the number of per-process slots in the bitmap.
+ */
+LLVM_COVMAP_READER_API uint64_t llvm_covmap_reader_slots(const llvm_covmap_reader *reader);
+
+/**
+ * Get the size of each slot of the bitmap, in bytes. The number of bits in the bitmap is 8 times this size.
+ */
+LLVM_COVMAP_READER_API uint64_t llvm_covmap_reader_size(const llvm_covmap_reader *reader);
+
+/**
+ * Get a pointer to the first byte of the given slot of the bitmap, or NULL if the slot does not exist.
+ */
+LLVM_COVMAP_READER_API const uint8_t *llvm_covmap_reader_bitmap(const llvm_covmap_reader *reader, uint64_t slot);
+
+/**
+ * Get the module registry of the bitmap, or NULL if the bitmap has no module registry.
+ *
+ * The registry is only attached if its header is consistent with its size. Use llvm_covmap_reader_foreach_module to
+ * walk its modules.
+ */
+LLVM_COVMAP_READER_API const struct llvm_covmap_registry *llvm_covmap_reader_registry(
+    const llvm_covmap_reader *reader);
+
+/**
+ * Invoke the callback for every module in the registry that has been registered completely and whose bits lie within
+ * the bitmap, in registration order. A module registered after the bitmap was mapped is visited once the reader has
+ * been reloaded.
+ *
+ * @return 0 after visiting all modules or if the bitmap has no module registry, or the nonzero value returned by the
+ * callback that stopped the iteration.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_foreach_module(
+    const llvm_covmap_reader *reader, llvm_covmap_visit_module_fn visit, void *context);
+
+/**
+ * Count the number of bits set in the union of all slots.
+ */
+LLVM_COVMAP_READER_API uint64_t llvm_covmap_reader_count(const llvm_covmap_reader *reader);
+
+/**
+ * Count the number of bits set in the given slot, or 0 if the slot does not exist.
+ */
+LLVM_COVMAP_READER_API uint64_t llvm_covmap_reader_count_slot(const llvm_covmap_reader *reader, uint64_t slot);
+
+/**
+ * Count the number of bits set in the union of all slots within the bits [begin, end). The range is clamped to the
+ * bitmap.
+ */
+LLVM_COVMAP_READER_API uint64_t llvm_covmap_reader_count_range(
+    const llvm_covmap_reader *reader, uint64_t begin, uint64_t end);
+
+/**
+ * Test whether the given bit is set in any slot.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_test(const llvm_covmap_reader *reader, uint64_t bit);
+
+/**
+ * Invoke the callback for every bit set in the union of all slots, in ascending order.
+ *
+ * @return 0 after visiting all bits, or the nonzero value returned by the callback that stopped the iteration.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_foreach(
+    const llvm_covmap_reader *reader, llvm_covmap_visit_fn visit, void *context);
+
+/**
+ * Count the number of bits in the result of a set operation between the bitmaps of two readers.
+ *
+ * @param count receives the number of bits.
+ * @return 0 on success, or -EINVAL if the bitmaps differ in size or the operation is unknown.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_count_op(
+    const llvm_covmap_reader *lhs, const llvm_covmap_reader *rhs, enum llvm_covmap_set_op op, uint64_t *count);
+
+/**
+ * Invoke the callback for every bit in the result of a set operation between the bitmaps of two readers, in ascending
+ * order. The result is computed on the fly and never materialized.
+ *
+ * @return 0 after visiting all bits, the nonzero value returned by the callback that stopped the iteration, or -EINVAL
+ * if the bitmaps differ in size or the operation is unknown.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_foreach_op(
+    const llvm_covmap_reader *lhs, const llvm_covmap_reader *rhs, enum llvm_covmap_set_op op,
+    llvm_covmap_visit_fn visit, void *context);
+
+/**
+ * Write a snapshot of the bitmap to the given path, and of the module registry to the path followed by
+ * LLVM_COVMAP_REGISTRY_SUFFIX. Each file is written to a temporary file first and renamed into place, so concurrent
+ * readers of the snapshot never observe a partial file.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_snapshot(const llvm_covmap_reader *reader, const char *path);
+
+/**
+ * Load a symbol map written by the instrumentation pass, see LLVM_COVMAP_SYMBOL_MAP. Symbols loaded earlier are kept;
+ * a later entry for the same function replaces an earlier one.
+ */
+LLVM_COVMAP_READER_API int llvm_covmap_reader_load_symbols(llvm_covmap_reader *reader, const char *path);
+
+/**
+ * Get the name of a function recorded in the given bit, or NULL if no loaded symbol maps to the bit. If several
+ * functions map to the bit, one of them is returned.
+ *
+ * Functions compiled with dense function IDs are resolved through the module registry, so they are only found once
+ * their module has registered itself.
+ *
+ * The returned string remains valid until the reader is closed.
+ */
+LLVM_COVMAP_READER_API const char *llvm_covmap_reader_symbol(llvm_covmap_reader *reader, uint64_t bit);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // LLVM_COVMAP_READER_READER_H
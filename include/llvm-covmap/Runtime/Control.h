@@ -0,0 +1,36 @@
+#ifndef LLVM_COVMAP_RUNTIME_CONTROL_H
+#define LLVM_COVMAP_RUNTIME_CONTROL_H
+
+/*
+ * Layout of the control block shared between the runtime library and the utilities.
+ *
+ * The control block lets utilities switch coverage collection on and off while the instrumented program is running.
+ * It is stored in a POSIX shared memory object whose name is the name of the coverage bitmap followed by
+ * LLVM_COVMAP_CONTROL_SUFFIX.
+ *
+ * This header is included by both C and C++ sources.
+ */
+
+#include <stdint.h>
+
+#define LLVM_COVMAP_CONTROL_SUFFIX ".control"
+
+/**
+ * Set in the control word while coverage is being collected.
+ */
+#define LLVM_COVMAP_CONTROL_ENABLED 0x1u
+
+struct llvm_covmap_control {
+  /**
+   * The control word, read by every probe.
+   */
+  uint32_t word;
+
+  /**
+   * Incremented by utilities whenever they switch collection on. One-shot probes hit while collection is switched off
+   * are disarmed like recorded ones, and re-armed by the runtime once it observes a new generation.
+   */
+  uint32_t generation;
+};
+
+#endif // LLVM_COVMAP_RUNTIME_CONTROL_H
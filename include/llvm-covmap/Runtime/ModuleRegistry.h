@@ -0,0 +1,97 @@
+#ifndef LLVM_COVMAP_RUNTIME_MODULE_REGISTRY_H
+#define LLVM_COVMAP_RUNTIME_MODULE_REGISTRY_H
+
+/*
+ * Layout of the module registry shared between the runtime library and the utilities.
+ *
+ * Modules compiled with dense function IDs register themselves with the runtime, which assigns each of them a
+ * contiguous range of bits in the coverage bitmap. The assignments are published in a POSIX shared memory object
+ * whose name is the name of the coverage bitmap followed by LLVM_COVMAP_REGISTRY_SUFFIX.
+ *
+ * This header is included by both C and C++ sources.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LLVM_COVMAP_REGISTRY_SUFFIX ".modules"
+#define LLVM_COVMAP_REGISTRY_MAGIC 0x50414d564f434d4cull
+#define LLVM_COVMAP_REGISTRY_VERSION 2
+
+#define LLVM_COVMAP_MODULE_NAME_SIZE 104
+
+/**
+ * A registered module.
+ */
+struct llvm_covmap_module {
+  /**
+   * Nonzero if the entry has been completely written. Entries are allocated before they are filled.
+   */
+  uint64_t ready;
+
+  /**
+   * Offset of the first bit assigned to the module.
+   */
+  uint64_t base;
+
+  /**
+   * Number of bits assigned to the module.
+   */
+  uint64_t count;
+
+  /**
+   * Random ID assigned to the module by the instrumentation pass, which tells apart different compilations of the same
+   * source file. The symbol map written by the pass refers to modules by this ID.
+   */
+  uint64_t id;
+
+  /**
+   * FNV-1a hash of the full identity of the module, "<shared object path>:<source file>", which unlike the name is
+   * never truncated.
+   */
+  uint64_t hash;
+
+  /**
+   * NUL-terminated identity of the module, in the form of "<shared object>:<source file>", truncated to fit. For
+   * display only; use id and hash to identify the module.
+   */
+  char name[LLVM_COVMAP_MODULE_NAME_SIZE];
+};
+
+/**
+ * Header of the module registry, followed by `capacity` module entries.
+ */
+struct llvm_covmap_registry {
+  /**
+   * Set to LLVM_COVMAP_REGISTRY_MAGIC once the rest of the header has been initialized.
+   */
+  uint64_t magic;
+  uint64_t version;
+
+  /**
+   * Maximum number of module entries.
+   */
+  uint64_t capacity;
+
+  /**
+   * Number of allocated module entries.
+   */
+  uint64_t count;
+
+  /**
+   * The first bit that has not been assigned to any module yet.
+   */
+  uint64_t next_bit;
+
+  uint64_t reserved[3];
+
+  /**
+   * Robust, process-shared mutex serializing registrations of all processes sharing the registry. Readers do not need
+   * to take it.
+   */
+  pthread_mutex_t lock;
+
+  struct llvm_covmap_module modules[];
+};
+
+#endif // LLVM_COVMAP_RUNTIME_MODULE_REGISTRY_H
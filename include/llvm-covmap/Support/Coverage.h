@@ -0,0 +1,46 @@
+#ifndef LLVM_COVMAP_SUPPORT_COVERAGE_H
+#define LLVM_COVMAP_SUPPORT_COVERAGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Count the number of bits set in the given coverage bitmap.
+ *
+ * @param bitmap pointer to the first byte of the bitmap. Must be aligned to 8 bytes.
+ * @param size the size of the bitmap, in bytes. Must be a multiple of 8.
+ * @return the number of bits set in the bitmap.
+ */
+size_t CountCoveredBits(const void *bitmap, size_t size) noexcept;
+
+/**
+ * Count the number of bits set within the given range of bits of a coverage bitmap.
+ *
+ * @param bitmap pointer to the first byte of the bitmap. Must be aligned to 8 bytes.
+ * @param begin offset of the first bit in the range.
+ * @param end offset of the bit past the last bit in the range.
+ * @return the number of bits set in the range.
+ */
+size_t CountCoveredBitsInRange(const void *bitmap, uint64_t begin, uint64_t end) noexcept;
+
+/**
+ * Count the number of bits set in the union of several consecutive coverage bitmaps of the same size, without
+ * materializing the union.
+ *
+ * @param bitmaps pointer to the first byte of the first bitmap. Must be aligned to 8 bytes.
+ * @param size the size of each bitmap, in bytes. Must be a multiple of 8.
+ * @param count the number of bitmaps.
+ * @return the number of bits set in the union of the bitmaps.
+ */
+size_t CountMergedCoveredBits(const void *bitmaps, size_t size, size_t count) noexcept;
+
+/**
+ * Merge a coverage bitmap into another one of the same size, that is, compute the bitwise OR of the two bitmaps.
+ *
+ * @param dst pointer to the first byte of the bitmap receiving the union. Must be aligned to 8 bytes.
+ * @param src pointer to the first byte of the bitmap to merge. Must be aligned to 8 bytes.
+ * @param size the size of each bitmap, in bytes. Must be a multiple of 8.
+ */
+void MergeCoverage(void *dst, const void *src, size_t size) noexcept;
+
+#endif // LLVM_COVMAP_SUPPORT_COVERAGE_H
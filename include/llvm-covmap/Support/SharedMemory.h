@@ -13,7 +13,10 @@
 class SharedMemory {
 public:
   /**
-   * Construct a new SharedMemory object.
+   * Construct a new SharedMemory object, creating the shared memory object if it does not exist.
+   *
+   * If the shared memory object already exists and is larger than the requested size, it is not shrunk and the whole
+   * object is mapped. The shared memory object is unlinked when this object is destroyed.
    *
    * This function throws std::system_error if shared memory creation fails.
    *
@@ -22,6 +25,17 @@ public:
    */
   explicit SharedMemory(const char *name, size_t size);
 
+  /**
+   * Construct a new SharedMemory object that attaches to an existing shared memory object, read-only.
+   *
+   * The whole shared memory object is mapped. The shared memory object is not unlinked when this object is destroyed.
+   *
+   * This function throws std::system_error if the shared memory object cannot be attached.
+   *
+   * @param name the name of the shared memory object.
+   */
+  explicit SharedMemory(const char *name);
+
   SharedMemory(const SharedMemory &) = delete;
   SharedMemory(SharedMemory &&) noexcept = delete;
 
@@ -57,11 +71,25 @@ public:
     return _base;
   }
 
+  /**
+   * Re-map the shared memory region if the shared memory object has been resized by another process.
+   *
+   * Pointers obtained from base() are invalidated if the region is re-mapped.
+   *
+   * This function throws std::system_error if the shared memory object cannot be re-mapped.
+   *
+   * @return true if the shared memory region has been re-mapped.
+   */
+  bool Reload();
+
 private:
   const char* _name;
   size_t _size;
   void *_base;
   int _fd;
+  bool _owner;
+
+  void Map(size_t size);
 };
 
 #endif // LLVM_COVMAP_SUPPORT_SHARED_MEMORY_H
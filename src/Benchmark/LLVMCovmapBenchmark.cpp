@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cxxopts.hpp>
+
+#include "llvm-covmap/Runtime/Control.h"
+#include "llvm-covmap/Support/Coverage.h"
+#include "llvm-covmap/Support/SharedMemory.h"
+
+extern "C" void __llvm_covmap_hit_function(uint64_t functionId);
+extern "C" void __llvm_covmap_hit_function_once(uint64_t functionId, uint8_t *guard);
+extern "C" void __llvm_covmap_register_module(const char *moduleName, uint64_t moduleId, uint64_t functionCount,
+                                              uint64_t *moduleBase);
+extern "C" llvm_covmap_control *const __llvm_covmap_control;
+
+namespace {
+
+constexpr static const char *OptPathEnvName = "LLVM_COVMAP_OPT";
+
+// Variables through which the runtime of this process would leak into the processes run by the shell and pass suites.
+constexpr static const char *RuntimeEnvNames[] = {
+    "LLVM_COVMAP_SHM_NAME",
+    "LLVM_COVMAP_OWNER",
+    "LLVM_COVMAP_SLOT",
+};
+
+constexpr static const uint64_t HotFunctionId = 42;
+constexpr static const uint64_t FunctionIdMultiplier = 0x9E3779B97F4A7C15ull;
+
+struct BenchmarkResult {
+  const char *suite;
+  std::string name;
+  uint64_t iterations;
+  uint64_t elapsed;
+  uint64_t operations;
+  const char *unit;
+};
+
+/**
+ * An instrumentation mode to be measured by the probe suite.
+ */
+struct ProbeMode {
+  const char *name;
+  void (*probe)(uint64_t functionId);
+  uint32_t controlWord;
+
+  /**
+   * Prepare the runtime for the probe, as the module constructors emitted by the pass would. May be null.
+   */
+  void (*setup)();
+};
+
+__attribute__((noinline))
+void EmptyProbe(uint64_t functionId) {
+  asm volatile("" : : "r"(functionId) : "memory");
+}
+
+constexpr static const size_t OneShotGuardCount = 1 << 16;
+uint8_t OneShotGuards[OneShotGuardCount];
+
+void ResetOneShotGuards() {
+  std::memset(OneShotGuards, 0, sizeof(OneShotGuards));
+}
+
+/**
+ * Mirror the guarded probe emitted by the pass under LLVM_COVMAP_ONE_SHOT.
+ */
+__attribute__((noinline))
+void OneShotProbe(uint64_t functionId) {
+  auto guard = &OneShotGuards[functionId % OneShotGuardCount];
+  if (__builtin_expect(*guard == 0, 0)) {
+    __llvm_covmap_hit_function_once(functionId, guard);
+  }
+}
+
+constexpr static const size_t FuzzerCounterCount = 1 << 16;
+uint8_t FuzzerCounters[FuzzerCounterCount];
+
+/**
+ * Mirror the probe emitted by the pass under LLVM_COVMAP_FUZZER_COUNTERS: an inline increment of the 8-bit counter of
+ * the function, followed by the usual call into the runtime.
+ */
+__attribute__((noinline))
+void FuzzerCounterProbe(uint64_t functionId) {
+  // The pass emits a plain load, add and store; relaxed atomics keep the concurrent runs of the suite well-defined
+  // without adding a locked instruction.
+  auto counter = &FuzzerCounters[functionId % FuzzerCounterCount];
+  __atomic_store_n(counter, static_cast<uint8_t>(__atomic_load_n(counter, __ATOMIC_RELAXED) + 1), __ATOMIC_RELAXED);
+  __llvm_covmap_hit_function(functionId);
+}
+
+constexpr static const uint64_t DenseFunctionCount = 1 << 16;
+constexpr static const uint64_t DenseModuleId = 0x6C6C766D2D62656Eull;
+uint64_t DenseModuleBase;
+
+void RegisterDenseModule() {
+  __llvm_covmap_register_module("LLVMCovmapBenchmark.cpp", DenseModuleId, DenseFunctionCount, &DenseModuleBase);
+}
+
+/**
+ * Mirror the probe emitted by the pass under LLVM_COVMAP_DENSE_IDS: a load of the base assigned to the module, plus
+ * the index of the function within the module.
+ */
+__attribute__((noinline))
+void DenseProbe(uint64_t functionId) {
+  __llvm_covmap_hit_function(__atomic_load_n(&DenseModuleBase, __ATOMIC_RELAXED) + functionId % DenseFunctionCount);
+}
+
+const ProbeMode ProbeModes[] = {
+    { "empty", EmptyProbe, LLVM_COVMAP_CONTROL_ENABLED, nullptr },
+    { "hash", __llvm_covmap_hit_function, LLVM_COVMAP_CONTROL_ENABLED, nullptr },
+    { "dense", DenseProbe, LLVM_COVMAP_CONTROL_ENABLED, RegisterDenseModule },
+    { "fuzzer-counters", FuzzerCounterProbe, LLVM_COVMAP_CONTROL_ENABLED, nullptr },
+    { "once", OneShotProbe, LLVM_COVMAP_CONTROL_ENABLED, ResetOneShotGuards },
+    { "once-paused", OneShotProbe, 0, ResetOneShotGuards },
+    { "paused", __llvm_covmap_hit_function, 0, nullptr },
+};
+
+uint64_t Now() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WriteHeader(std::ostream &out) {
+  out << "suite,case,iterations,elapsed_ns,ns_per_op,ops_per_sec,unit" << std::endl;
+}
+
+void WriteResult(std::ostream &out, const BenchmarkResult &result) {
+  auto nsPerOp = result.operations ? static_cast<double>(result.elapsed) / result.operations : 0.0;
+  auto opsPerSec = result.elapsed ? static_cast<double>(result.operations) * 1e9 / result.elapsed : 0.0;
+  out << result.suite << ","
+      << result.name << ","
+      << result.iterations << ","
+      << result.elapsed << ","
+      << nsPerOp << ","
+      << opsPerSec << ","
+      << result.unit << std::endl;
+}
+
+void RunProbeSuite(std::ostream &out, const std::vector<unsigned> &threadCounts, uint64_t iterations) {
+  for (const auto &mode : ProbeModes) {
+    // Mount the bitmap before the clock starts so that only the steady-state cost is measured.
+    if (mode.setup) {
+      mode.setup();
+    }
+    mode.probe(HotFunctionId);
+    __atomic_store_n(&__llvm_covmap_control->word, mode.controlWord, __ATOMIC_RELAXED);
+
+    for (auto hot : { false, true }) {
+      for (auto threadCount : threadCounts) {
+        std::atomic<bool> start { false };
+        std::vector<std::thread> workers;
+        workers.reserve(threadCount);
+
+        for (unsigned t = 0; t < threadCount; ++t) {
+          workers.emplace_back([&start, &mode, hot, iterations, t]() {
+            while (!start.load(std::memory_order_acquire)) {
+              std::this_thread::yield();
+            }
+            auto base = static_cast<uint64_t>(t) * iterations;
+            for (uint64_t i = 0; i < iterations; ++i) {
+              mode.probe(hot ? HotFunctionId : (base + i) * FunctionIdMultiplier);
+            }
+          });
+        }
+
+        auto begin = Now();
+        start.store(true, std::memory_order_release);
+        for (auto &worker : workers) {
+          worker.join();
+        }
+        auto elapsed = Now() - begin;
+
+        // Report per-thread latency: every thread performs `iterations` probes concurrently.
+        WriteResult(out, {
+            "probe",
+            std::string("mode=") + mode.name
+                + ";ids=" + (hot ? "hot" : "spread")
+                + ";threads=" + std::to_string(threadCount),
+            iterations,
+            elapsed,
+            iterations,
+            "probe",
+        });
+      }
+    }
+
+    // Switch collection on again the way the watcher does, which re-arms the one-shot probes hit while paused.
+    __atomic_add_fetch(&__llvm_covmap_control->generation, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&__llvm_covmap_control->word, LLVM_COVMAP_CONTROL_ENABLED, __ATOMIC_RELAXED);
+  }
+}
+
+void RunScanSuite(std::ostream &out, const std::vector<size_t> &sizes, const std::vector<double> &densities,
+                  size_t scanBytes) {
+  std::mt19937_64 rnd { 0 };
+
+  for (auto size : sizes) {
+    std::vector<uint64_t> bitmap(size / 8);
+
+    for (auto density : densities) {
+      std::bernoulli_distribution dist { density };
+      for (auto &word : bitmap) {
+        word = 0;
+        for (auto bit = 0; bit < 64; ++bit) {
+          if (dist(rnd)) {
+            word |= 1ull << bit;
+          }
+        }
+      }
+
+      uint64_t iterations = size ? std::max<size_t>(1, scanBytes / size) : 0;
+      volatile size_t sink = 0;
+
+      auto begin = Now();
+      for (uint64_t i = 0; i < iterations; ++i) {
+        sink = sink + CountCoveredBits(bitmap.data(), size);
+      }
+      auto elapsed = Now() - begin;
+
+      WriteResult(out, {
+          "scan",
+          "size=" + std::to_string(size) + ";density=" + std::to_string(density),
+          iterations,
+          elapsed,
+          iterations * size,
+          "byte",
+      });
+    }
+  }
+}
+
+/**
+ * Run the given command to completion with its standard streams redirected to /dev/null.
+ *
+ * @return the wall time spent from fork to reap, in nanoseconds.
+ */
+uint64_t RunProcess(const std::vector<std::string> &args) {
+  std::vector<const char *> nativeArgs;
+  nativeArgs.reserve(args.size() + 1);
+  for (const auto &e : args) {
+    nativeArgs.push_back(e.data());
+  }
+  nativeArgs.push_back(nullptr);
+
+  auto begin = Now();
+
+  auto pid = fork();
+  if (pid == -1) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "fork failed" };
+  }
+  if (pid == 0) {
+    for (auto name : RuntimeEnvNames) {
+      unsetenv(name);
+    }
+
+    auto devNull = open("/dev/null", O_RDWR);
+    if (devNull != -1) {
+      dup2(devNull, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+    }
+    execvp(nativeArgs[0], const_cast<char *const *>(nativeArgs.data()));
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) == -1) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "waitpid failed" };
+  }
+
+  auto elapsed = Now() - begin;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    throw std::runtime_error { "cannot execute " + args[0] };
+  }
+
+  return elapsed;
+}
+
+void RunShellSuite(std::ostream &out, const std::vector<size_t> &sizes, unsigned iterations,
+                   const std::string &target) {
+  auto shmName = "LLVMCovmapBench." + std::to_string(getpid());
+
+  for (auto size : sizes) {
+    uint64_t elapsed = 0;
+    for (unsigned i = 0; i < iterations; ++i) {
+      auto begin = Now();
+      {
+        SharedMemory shm { shmName.c_str(), size };
+      }
+      elapsed += Now() - begin;
+    }
+
+    WriteResult(out, {
+        "shell",
+        "case=mount;size=" + std::to_string(size),
+        iterations,
+        elapsed,
+        iterations,
+        "run",
+    });
+
+    std::vector<std::pair<const char *, std::vector<std::string>>> cases {
+        { "exec", { target } },
+        { "covmap-shell", {
+            LLVM_COVMAP_SHELL_PATH, "--name", shmName, "--size", std::to_string(size), "--", target
+        } },
+    };
+
+    for (const auto &c : cases) {
+      elapsed = 0;
+      for (unsigned i = 0; i < iterations; ++i) {
+        elapsed += RunProcess(c.second);
+      }
+
+      WriteResult(out, {
+          "shell",
+          std::string("case=") + c.first + ";size=" + std::to_string(size),
+          iterations,
+          elapsed,
+          iterations,
+          "run",
+      });
+    }
+  }
+}
+
+std::string GenerateModule(unsigned functionCount) {
+  char path[] = "/tmp/llvm-covmap-bench-XXXXXX.ll";
+  auto fd = mkstemps(path, 3);
+  if (fd == -1) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "mkstemps failed" };
+  }
+  close(fd);
+
+  std::ofstream module { path };
+  for (unsigned i = 0; i < functionCount; ++i) {
+    module << "define i32 @f" << i << "(i32 %x) {\n"
+           << "entry:\n"
+           << "  %y = add i32 %x, " << i << "\n"
+           << "  ret i32 %y\n"
+           << "}\n\n";
+  }
+
+  return path;
+}
+
+void RunPassSuite(std::ostream &out, const std::vector<unsigned> &functionCounts, unsigned iterations) {
+  auto optPath = getenv(OptPathEnvName);
+  std::string opt { optPath ? optPath : "opt" };
+
+  for (auto functionCount : functionCounts) {
+    auto modulePath = GenerateModule(functionCount);
+
+    for (auto instrumented : { false, true }) {
+      std::vector<std::string> args { opt };
+#if LLVM_COVMAP_LLVM_VERSION_MAJOR >= 13
+      args.emplace_back("-enable-new-pm=0");
+#endif
+      if (instrumented) {
+        args.emplace_back("-load");
+        args.emplace_back(LLVM_COVMAP_PASS_PATH);
+        args.emplace_back("-covmap");
+      }
+      args.emplace_back("-o");
+      args.emplace_back("/dev/null");
+      args.push_back(modulePath);
+
+      uint64_t elapsed = 0;
+      for (unsigned i = 0; i < iterations; ++i) {
+        elapsed += RunProcess(args);
+      }
+
+      WriteResult(out, {
+          "pass",
+          "functions=" + std::to_string(functionCount) + ";instrumented=" + (instrumented ? "1" : "0"),
+          iterations,
+          elapsed,
+          static_cast<uint64_t>(iterations) * functionCount,
+          "function",
+      });
+    }
+
+    unlink(modulePath.c_str());
+  }
+}
+
+} // namespace <anonymous>
+
+int main(int argc, char **argv) {
+  cxxopts::Options options {
+    "llvm-covmap-bench",
+    "Measure probe overhead, bitmap scan throughput, shell overhead and instrumentation time"
+  };
+
+  options.add_options()
+      ("h,help", "Dump help message")
+      ("o,output", "Write CSV results to the given file instead of stdout",
+          cxxopts::value<std::string>()
+              ->default_value(""))
+      ("suites", "Comma separated list of suites to run (probe, scan, shell, pass)",
+          cxxopts::value<std::vector<std::string>>()
+              ->default_value("probe,scan,shell,pass"))
+      ("threads", "Thread counts for the probe suite",
+          cxxopts::value<std::vector<unsigned>>()
+              ->default_value("1,2,4,8"))
+      ("probe-iterations", "Number of probes issued by each thread",
+          cxxopts::value<uint64_t>()
+              ->default_value("10000000"))
+      ("sizes", "Bitmap sizes for the scan and shell suites, in bytes",
+          cxxopts::value<std::vector<size_t>>()
+              ->default_value("65536,1048576,16777216"))
+      ("densities", "Ratios of set bits for the scan suite",
+          cxxopts::value<std::vector<double>>()
+              ->default_value("0,0.01,0.5,1"))
+      ("scan-bytes", "Number of bytes to scan for each scan case",
+          cxxopts::value<size_t>()
+              ->default_value("1073741824"))
+      ("shell-iterations", "Number of runs for each shell case",
+          cxxopts::value<unsigned>()
+              ->default_value("100"))
+      ("shell-target", "The program run by the shell suite",
+          cxxopts::value<std::string>()
+              ->default_value("true"))
+      ("functions", "Module sizes for the pass suite, in functions",
+          cxxopts::value<std::vector<unsigned>>()
+              ->default_value("1000,10000,100000"))
+      ("pass-iterations", "Number of opt runs for each pass case",
+          cxxopts::value<unsigned>()
+              ->default_value("3"));
+
+  auto args = options.parse(argc, argv);
+  if (args.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  const auto &sizes = args["sizes"].as<std::vector<size_t>>();
+  for (auto size : sizes) {
+    if (size & 7) {
+      std::cerr << "Bitmap sizes should be multiples of 8" << std::endl;
+      return 1;
+    }
+  }
+
+  std::ofstream outputFile;
+  std::ostream *out = &std::cout;
+  const auto &outputPath = args["output"].as<std::string>();
+  if (!outputPath.empty()) {
+    outputFile.open(outputPath);
+    if (!outputFile) {
+      std::cerr << "Cannot open output file " << outputPath << std::endl;
+      return 1;
+    }
+    out = &outputFile;
+  }
+
+  const auto &suites = args["suites"].as<std::vector<std::string>>();
+
+  // The probe suite drives the runtime linked into this very process. Mount its bitmap up front and drop the variable
+  // again, so that the processes forked by the other suites neither inherit the bitmap nor mount it inside the timed
+  // fork.
+  if (std::find(suites.begin(), suites.end(), "probe") != suites.end()) {
+    auto shmName = "LLVMCovmapBenchProbe." + std::to_string(getpid());
+    setenv("LLVM_COVMAP_SHM_NAME", shmName.c_str(), 1);
+    __llvm_covmap_hit_function(HotFunctionId);
+  }
+  unsetenv("LLVM_COVMAP_SHM_NAME");
+
+  WriteHeader(*out);
+
+  try {
+    for (const auto &suite : suites) {
+      if (suite == "probe") {
+        RunProbeSuite(*out, args["threads"].as<std::vector<unsigned>>(), args["probe-iterations"].as<uint64_t>());
+      } else if (suite == "scan") {
+        RunScanSuite(*out, sizes, args["densities"].as<std::vector<double>>(), args["scan-bytes"].as<size_t>());
+      } else if (suite == "shell") {
+        RunShellSuite(*out, sizes, args["shell-iterations"].as<unsigned>(), args["shell-target"].as<std::string>());
+      } else if (suite == "pass") {
+        RunPassSuite(*out, args["functions"].as<std::vector<unsigned>>(), args["pass-iterations"].as<unsigned>());
+      } else {
+        std::cerr << "Unknown suite: " << suite << std::endl;
+        return 1;
+      }
+    }
+  } catch (const std::exception &err) {
+    std::cerr << "Benchmark failed: " << err.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -58,6 +58,7 @@ int main(int argc, char **argv) {
   if (!compiling) {
     args.emplace_back("-l" LLVM_COVMAP_RUNTIME_LIBRARY_NAME);
     args.emplace_back("-lrt");
+    args.emplace_back("-ldl");
   }
 
   ExecuteUtility(args, WrapperName, "clang++");
@@ -6,22 +6,45 @@
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <llvm/Pass.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 
 namespace llvm {
 
 namespace covmap {
 
 constexpr static const char *CoverageFunctionName = "__llvm_covmap_hit_function";
+constexpr static const char *OneShotCoverageFunctionName = "__llvm_covmap_hit_function_once";
+constexpr static const char *RegisterModuleFunctionName = "__llvm_covmap_register_module";
+constexpr static const char *RegisterGuardsFunctionName = "__llvm_covmap_register_guards";
+constexpr static const char *UnregisterGuardsFunctionName = "__llvm_covmap_unregister_guards";
+constexpr static const char *ModuleBaseName = "__llvm_covmap_module_base";
+constexpr static const char *ModuleConstructorName = "__llvm_covmap_module_ctor";
+constexpr static const char *ModuleDestructorName = "__llvm_covmap_module_dtor";
+constexpr static const char *FuzzerCountersName = "__llvm_covmap_fuzzer_counters";
+constexpr static const char *GuardsName = "__llvm_covmap_guards";
+
+// libFuzzer collects extra features from the bytes between __start___libfuzzer_extra_counters and
+// __stop___libfuzzer_extra_counters, which the linker defines for this section.
+constexpr static const char *FuzzerCountersSectionName = "__libfuzzer_extra_counters";
 
 constexpr static const uint32_t DefaultInstrumentationRatio = 100;
 
@@ -32,6 +55,80 @@ static llvm::FunctionType *GetCoverageFunctionType(llvm::LLVMContext &context) n
   return llvm::FunctionType::get(voidType, argTypes, false);
 }
 
+static llvm::FunctionType *GetOneShotCoverageFunctionType(llvm::LLVMContext &context) noexcept {
+  llvm::Type *argTypes[2] = {
+      llvm::IntegerType::get(context, 64),
+      llvm::Type::getInt8PtrTy(context),
+  };
+  auto voidType = llvm::Type::getVoidTy(context);
+  return llvm::FunctionType::get(voidType, argTypes, false);
+}
+
+static llvm::FunctionType *GetRegisterGuardsFunctionType(llvm::LLVMContext &context) noexcept {
+  llvm::Type *argTypes[2] = {
+      llvm::Type::getInt8PtrTy(context),
+      llvm::IntegerType::get(context, 64),
+  };
+  auto voidType = llvm::Type::getVoidTy(context);
+  return llvm::FunctionType::get(voidType, argTypes, false);
+}
+
+static llvm::FunctionType *GetUnregisterGuardsFunctionType(llvm::LLVMContext &context) noexcept {
+  llvm::Type *argTypes[1] = { llvm::Type::getInt8PtrTy(context) };
+  auto voidType = llvm::Type::getVoidTy(context);
+  return llvm::FunctionType::get(voidType, argTypes, false);
+}
+
+static llvm::FunctionType *GetRegisterModuleFunctionType(llvm::LLVMContext &context) noexcept {
+  auto uint64Type = llvm::IntegerType::get(context, 64);
+  llvm::Type *argTypes[4] = {
+      llvm::Type::getInt8PtrTy(context),
+      uint64Type,
+      uint64Type,
+      uint64Type->getPointerTo(),
+  };
+  auto voidType = llvm::Type::getVoidTy(context);
+  return llvm::FunctionType::get(voidType, argTypes, false);
+}
+
+static bool IsEnabledByEnv(const char *name) noexcept {
+  auto valueStr = getenv(name);
+  return valueStr && *valueStr && std::strcmp(valueStr, "0") != 0;
+}
+
+static bool IsDenseIdsEnabled() noexcept {
+  return IsEnabledByEnv("LLVM_COVMAP_DENSE_IDS");
+}
+
+static bool IsFuzzerCountersEnabled() noexcept {
+  return IsEnabledByEnv("LLVM_COVMAP_FUZZER_COUNTERS");
+}
+
+static bool IsOneShotEnabled() noexcept {
+  return IsEnabledByEnv("LLVM_COVMAP_ONE_SHOT");
+}
+
+/**
+ * Append the given lines to the symbol map file.
+ *
+ * Several compilers might append to the same file concurrently, so all lines of a module are written with a single
+ * write to a file opened in append mode.
+ */
+static void AppendSymbolMap(const char *path, const std::string &lines) noexcept {
+  auto fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    llvm::errs() << "llvm-covmap: cannot open symbol map " << path << ": " << std::strerror(errno) << "\n";
+    return;
+  }
+
+  auto written = write(fd, lines.data(), lines.size());
+  if (written != static_cast<ssize_t>(lines.size())) {
+    llvm::errs() << "llvm-covmap: cannot write symbol map " << path << "\n";
+  }
+
+  close(fd);
+}
+
 static unsigned GetInstrumentationRatio() noexcept {
   auto ratioStr = getenv("LLVM_COVMAP_INST_RATIO");
   if (!ratioStr) {
@@ -57,16 +154,19 @@ public:
   { }
 
   bool runOnModule(llvm::Module &module) final {
-    if (module.getFunction(CoverageFunctionName)) {
+    if (module.getFunction(CoverageFunctionName) || module.getFunction(OneShotCoverageFunctionName)) {
       // Already instrumented.
       return false;
     }
 
-    auto coverageFunctionType = GetCoverageFunctionType(module.getContext());
-    auto coverageFunctionCallee = module.getOrInsertFunction(CoverageFunctionName, coverageFunctionType);
+    auto oneShot = IsOneShotEnabled();
+    auto coverageFunctionCallee = oneShot
+        ? module.getOrInsertFunction(OneShotCoverageFunctionName, GetOneShotCoverageFunctionType(module.getContext()))
+        : module.getOrInsertFunction(CoverageFunctionName, GetCoverageFunctionType(module.getContext()));
 
     auto ratio = GetInstrumentationRatio();
 
+    std::vector<llvm::Function *> functions;
     for (auto &function : module) {
       if (function.isDeclaration()) {
         continue;
@@ -76,12 +176,96 @@ public:
         continue;
       }
 
-      auto functionId = Random();
-      auto &entryBlock = function.getEntryBlock();
-      IRBuilder<> builder { &entryBlock, entryBlock.begin() };
+      functions.push_back(&function);
+    }
+
+    // With dense IDs, the functions in this module are numbered from 0 and offset at runtime by the base assigned to
+    // the module when it registers itself.
+    llvm::GlobalVariable *moduleBase = nullptr;
+    uint64_t moduleId = 0;
+    if (IsDenseIdsEnabled() && !functions.empty()) {
+      moduleId = Random();
+      moduleBase = CreateModuleRegistration(module, moduleId, functions.size());
+    }
+
+    // With fuzzer counters, every instrumented function also bumps its own 8-bit counter, which libFuzzer consumes as
+    // extra coverage features. This lets a single instrumented build drive both libFuzzer and the coverage bitmap.
+    llvm::GlobalVariable *fuzzerCounters = nullptr;
+    if (IsFuzzerCountersEnabled() && !functions.empty()) {
+      fuzzerCounters = CreateFuzzerCounters(module, functions.size());
+    }
 
-      llvm::Value *callArgs[1] = { builder.getInt64(functionId) };
-      builder.CreateCall(coverageFunctionCallee, callArgs);
+    // With one-shot probes, every instrumented function gets a guard byte that the runtime sets once the function has
+    // been recorded. Subsequent calls only test the guard and never call into the runtime.
+    llvm::GlobalVariable *guards = nullptr;
+    if (oneShot && !functions.empty()) {
+      guards = CreateGuards(module, functions.size());
+    }
+
+    // The symbol map lets analysis tools translate bits of the bitmap back to functions, see Reader.h.
+    auto symbolMapPath = getenv("LLVM_COVMAP_SYMBOL_MAP");
+    std::string symbolMap;
+
+    uint64_t functionIndex = 0;
+    for (auto function : functions) {
+      auto &entryBlock = function->getEntryBlock();
+      auto insertPoint = entryBlock.getFirstInsertionPt();
+      if (guards) {
+        // Splitting the entry block must leave static allocas in the entry block.
+        while (llvm::isa<llvm::AllocaInst>(*insertPoint)) {
+          ++insertPoint;
+        }
+      } else {
+        insertPoint = entryBlock.begin();
+      }
+      IRBuilder<> builder { &entryBlock, insertPoint };
+
+      if (fuzzerCounters) {
+        auto counter = builder.CreateConstInBoundsGEP2_64(
+            fuzzerCounters->getValueType(), fuzzerCounters, 0, functionIndex);
+        auto value = builder.CreateLoad(builder.getInt8Ty(), counter);
+        builder.CreateStore(builder.CreateAdd(value, builder.getInt8(1)), counter);
+      }
+
+      llvm::Value *guard = nullptr;
+      if (guards) {
+        guard = builder.CreateConstInBoundsGEP2_64(guards->getValueType(), guards, 0, functionIndex);
+        auto guardValue = builder.CreateLoad(builder.getInt8Ty(), guard);
+        auto unrecorded = builder.CreateICmpEQ(guardValue, builder.getInt8(0));
+        auto branchWeights = llvm::MDBuilder { module.getContext() }.createBranchWeights(1, 1 << 20);
+        auto recordTerm = llvm::SplitBlockAndInsertIfThen(unrecorded, &*builder.GetInsertPoint(), false, branchWeights);
+        builder.SetInsertPoint(recordTerm);
+      }
+
+      llvm::Value *functionId;
+      if (moduleBase) {
+        auto base = builder.CreateLoad(builder.getInt64Ty(), moduleBase);
+        functionId = builder.CreateAdd(base, builder.getInt64(functionIndex));
+        if (symbolMapPath) {
+          symbolMap += "dense\t" + std::to_string(moduleId) + "\t" + std::to_string(functionIndex) + "\t" +
+              function->getName().str() + "\t" + module.getSourceFileName() + "\n";
+        }
+      } else {
+        auto id = Random();
+        functionId = builder.getInt64(id);
+        if (symbolMapPath) {
+          symbolMap += "hash\t" + std::to_string(id) + "\t" + function->getName().str() + "\n";
+        }
+      }
+
+      if (guard) {
+        llvm::Value *callArgs[2] = { functionId, guard };
+        builder.CreateCall(coverageFunctionCallee, callArgs);
+      } else {
+        llvm::Value *callArgs[1] = { functionId };
+        builder.CreateCall(coverageFunctionCallee, callArgs);
+      }
+
+      ++functionIndex;
+    }
+
+    if (symbolMapPath && !symbolMap.empty()) {
+      AppendSymbolMap(symbolMapPath, symbolMap);
     }
 
     return true;
@@ -103,6 +287,130 @@ private:
   bool Probability(uint32_t ratio) noexcept {
     return Random<uint32_t>(0, 100) <= ratio;
   }
+
+  static llvm::Function *CreateEmptyFunction(llvm::Module &module, const char *name) {
+    auto &context = module.getContext();
+    auto functionType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), false);
+    auto function = llvm::Function::Create(functionType, llvm::GlobalValue::InternalLinkage, name, module);
+    auto entryBlock = llvm::BasicBlock::Create(context, "entry", function);
+    IRBuilder<> { entryBlock }.CreateRetVoid();
+    return function;
+  }
+
+  /**
+   * Get the module constructor that registers the module with the runtime, creating it if it does not exist.
+   *
+   * @return the terminator of the module constructor, before which registrations are inserted.
+   */
+  static llvm::Instruction *GetModuleConstructorTerminator(llvm::Module &module) {
+    auto constructor = module.getFunction(ModuleConstructorName);
+    if (!constructor) {
+      constructor = CreateEmptyFunction(module, ModuleConstructorName);
+
+      // Register before any other constructor of the module gets a chance to call an instrumented function.
+      llvm::appendToGlobalCtors(module, constructor, 0);
+    }
+
+    return constructor->getEntryBlock().getTerminator();
+  }
+
+  /**
+   * Get the module destructor that unregisters the module from the runtime, creating it if it does not exist.
+   *
+   * @return the terminator of the module destructor, before which unregistrations are inserted.
+   */
+  static llvm::Instruction *GetModuleDestructorTerminator(llvm::Module &module) {
+    auto destructor = module.getFunction(ModuleDestructorName);
+    if (!destructor) {
+      destructor = CreateEmptyFunction(module, ModuleDestructorName);
+      llvm::appendToGlobalDtors(module, destructor, 0);
+    }
+
+    return destructor->getEntryBlock().getTerminator();
+  }
+
+  /**
+   * Register the module with the runtime from the module constructor.
+   *
+   * @return the global variable that receives the first function ID assigned to the module.
+   */
+  static llvm::GlobalVariable *CreateModuleRegistration(llvm::Module &module, uint64_t moduleId,
+                                                        uint64_t functionCount) {
+    auto &context = module.getContext();
+    auto uint64Type = llvm::IntegerType::get(context, 64);
+
+    auto moduleBase = new llvm::GlobalVariable(
+        module, uint64Type, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantInt::get(uint64Type, 0), ModuleBaseName);
+
+    auto registerFunctionCallee = module.getOrInsertFunction(
+        RegisterModuleFunctionName, GetRegisterModuleFunctionType(context));
+
+    IRBuilder<> builder { GetModuleConstructorTerminator(module) };
+    llvm::Value *callArgs[4] = {
+        builder.CreateGlobalStringPtr(module.getSourceFileName()),
+        builder.getInt64(moduleId),
+        builder.getInt64(functionCount),
+        moduleBase,
+    };
+    builder.CreateCall(registerFunctionCallee, callArgs);
+
+    return moduleBase;
+  }
+
+  /**
+   * Create the guard bytes of one-shot probes, one for each instrumented function, and register them with the runtime
+   * from the module constructor.
+   *
+   * @return the global variable holding the guards.
+   */
+  static llvm::GlobalVariable *CreateGuards(llvm::Module &module, uint64_t functionCount) {
+    auto &context = module.getContext();
+    auto guardsType = llvm::ArrayType::get(llvm::IntegerType::get(context, 8), functionCount);
+    auto guards = new llvm::GlobalVariable(
+        module, guardsType, false, llvm::GlobalValue::InternalLinkage,
+        llvm::Constant::getNullValue(guardsType), GuardsName);
+
+    auto registerFunctionCallee = module.getOrInsertFunction(
+        RegisterGuardsFunctionName, GetRegisterGuardsFunctionType(context));
+
+    IRBuilder<> builder { GetModuleConstructorTerminator(module) };
+    llvm::Value *callArgs[2] = {
+        builder.CreateConstInBoundsGEP2_64(guardsType, guards, 0, 0),
+        builder.getInt64(functionCount),
+    };
+    builder.CreateCall(registerFunctionCallee, callArgs);
+
+    // The runtime resets the guards of every registered module in forked children, so a module must unregister its
+    // guards before it is unloaded.
+    auto unregisterFunctionCallee = module.getOrInsertFunction(
+        UnregisterGuardsFunctionName, GetUnregisterGuardsFunctionType(context));
+
+    builder.SetInsertPoint(GetModuleDestructorTerminator(module));
+    llvm::Value *unregisterCallArgs[1] = { builder.CreateConstInBoundsGEP2_64(guardsType, guards, 0, 0) };
+    builder.CreateCall(unregisterFunctionCallee, unregisterCallArgs);
+
+    return guards;
+  }
+
+  /**
+   * Create the array of 8-bit counters exposed to libFuzzer, one for each instrumented function.
+   *
+   * @return the global variable holding the counters.
+   */
+  static llvm::GlobalVariable *CreateFuzzerCounters(llvm::Module &module, uint64_t functionCount) {
+    auto countersType = llvm::ArrayType::get(llvm::IntegerType::get(module.getContext(), 8), functionCount);
+    auto counters = new llvm::GlobalVariable(
+        module, countersType, false, llvm::GlobalValue::InternalLinkage,
+        llvm::Constant::getNullValue(countersType), FuzzerCountersName);
+    counters->setSection(FuzzerCountersSectionName);
+    counters->setAlignment(llvm::MaybeAlign(1));
+
+    // Keep the counters even if they become unreferenced, since libFuzzer locates them by section only.
+    llvm::appendToCompilerUsed(module, { counters });
+
+    return counters;
+  }
 };
 
 char CoverageMapPass::ID = 0;
@@ -0,0 +1,646 @@
+#include "llvm-covmap/Reader/Reader.h"
+#include "llvm-covmap/Support/Coverage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bit N of the bitmap is bit N % 8 of byte N / 8, which is bit N % 64 of word N / 64 only on little-endian targets.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the reader assumes a little-endian target");
+
+namespace {
+
+[[noreturn]] void ThrowSystemError(const char *what) {
+  throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), what };
+}
+
+/**
+ * A read-only mapping of a POSIX shared memory object or a regular file.
+ */
+class Mapping {
+public:
+  /**
+   * Map the shared memory object or the file with the given name.
+   *
+   * This function throws std::system_error if the object cannot be opened or mapped.
+   */
+  explicit Mapping(const char *name, bool sharedMemory)
+    : _base(nullptr),
+      _size(0),
+      _fd(-1)
+  {
+    _fd = sharedMemory ? shm_open(name, O_RDONLY, 0) : open(name, O_RDONLY | O_CLOEXEC);
+    if (_fd == -1) {
+      ThrowSystemError(sharedMemory ? "shm_open failed" : "open failed");
+    }
+
+    try {
+      Reload();
+    } catch (...) {
+      close(_fd);
+      throw;
+    }
+  }
+
+  Mapping(const Mapping &) = delete;
+  Mapping(Mapping &&) noexcept = delete;
+
+  Mapping& operator=(const Mapping &) = delete;
+  Mapping& operator=(Mapping &&) noexcept = delete;
+
+  ~Mapping() noexcept {
+    if (_base) {
+      munmap(const_cast<uint8_t *>(_base), _size);
+    }
+    close(_fd);
+  }
+
+  const uint8_t *base() const noexcept {
+    return _base;
+  }
+
+  size_t size() const noexcept {
+    return _size;
+  }
+
+  /**
+   * Re-map the object if its size has changed.
+   *
+   * @return true if the object has been re-mapped.
+   */
+  bool Reload() {
+    struct stat st; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    if (fstat(_fd, &st) == -1) {
+      ThrowSystemError("fstat failed");
+    }
+
+    auto size = static_cast<size_t>(st.st_size);
+    if (_base && size == _size) {
+      return false;
+    }
+
+    auto base = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, _fd, 0) : nullptr;
+    if (base == MAP_FAILED) {
+      ThrowSystemError("mmap failed");
+    }
+
+    if (_base) {
+      munmap(const_cast<uint8_t *>(_base), _size);
+    }
+
+    _base = static_cast<const uint8_t *>(base);
+    _size = size;
+    return true;
+  }
+
+private:
+  const uint8_t *_base;
+  size_t _size;
+  int _fd;
+};
+
+/**
+ * Translate the exception being handled into a negated errno value.
+ */
+int CurrentErrorCode() noexcept {
+  try {
+    throw;
+  } catch (const std::system_error &err) {
+    return -err.code().value();
+  } catch (const std::bad_alloc &) {
+    return -ENOMEM;
+  } catch (...) {
+    return -EIO;
+  }
+}
+
+uint64_t LoadWord(const uint8_t *bitmap, uint64_t word) noexcept {
+  uint64_t value;
+  std::memcpy(&value, bitmap + word * 8, sizeof(value));
+  return value;
+}
+
+uint64_t CombineWords(uint64_t lhs, uint64_t rhs, llvm_covmap_set_op op) noexcept {
+  switch (op) {
+    case LLVM_COVMAP_SET_UNION:
+      return lhs | rhs;
+    case LLVM_COVMAP_SET_INTERSECTION:
+      return lhs & rhs;
+    case LLVM_COVMAP_SET_DIFFERENCE:
+      return lhs & ~rhs;
+  }
+  return 0;
+}
+
+bool IsValidSetOp(llvm_covmap_set_op op) noexcept {
+  return op == LLVM_COVMAP_SET_UNION || op == LLVM_COVMAP_SET_INTERSECTION || op == LLVM_COVMAP_SET_DIFFERENCE;
+}
+
+/**
+ * Invoke the callback for every bit set in the given word, which holds the bits starting from 64 * index.
+ */
+int VisitWord(uint64_t index, uint64_t value, llvm_covmap_visit_fn visit, void *context) {
+  while (value) {
+    auto bit = static_cast<uint64_t>(__builtin_ctzll(value));
+    auto ret = visit(index * 64 + bit, context);
+    if (ret) {
+      return ret;
+    }
+    value &= value - 1;
+  }
+  return 0;
+}
+
+/**
+ * Write the given bytes to a temporary file next to the given path and rename it into place.
+ */
+void WriteFileAtomically(const std::string &path, const uint8_t *data, size_t size) {
+  auto temporaryPath = path + ".tmp." + std::to_string(getpid());
+  auto fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    ThrowSystemError("open failed");
+  }
+
+  while (size > 0) {
+    auto written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      auto errorCode = errno;
+      close(fd);
+      unlink(temporaryPath.c_str());
+      errno = errorCode;
+      ThrowSystemError("write failed");
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+
+  if (close(fd) == -1) {
+    auto errorCode = errno;
+    unlink(temporaryPath.c_str());
+    errno = errorCode;
+    ThrowSystemError("close failed");
+  }
+
+  if (rename(temporaryPath.c_str(), path.c_str()) == -1) {
+    auto errorCode = errno;
+    unlink(temporaryPath.c_str());
+    errno = errorCode;
+    ThrowSystemError("rename failed");
+  }
+}
+
+} // namespace <anonymous>
+
+struct llvm_covmap_reader {
+  std::unique_ptr<Mapping> bitmap;
+  std::unique_ptr<Mapping> registry;
+  std::string registryName;
+
+  // Number of module entries that fit into the mapping of the registry. The capacity in the header of the registry is
+  // never trusted beyond this.
+  uint64_t registryCapacity;
+  bool sharedMemory;
+  uint64_t slots;
+
+  // Storage of the names of all loaded symbols; entries are never moved once appended.
+  std::deque<std::string> symbolNames;
+
+  // Symbols of functions with random IDs, keyed by function ID.
+  std::unordered_map<uint64_t, const char *> hashedSymbols;
+
+  // Symbols of functions with dense IDs, keyed by the ID the pass assigned to their module and indexed by the index of
+  // the function in its module.
+  std::unordered_map<uint64_t, std::vector<const char *>> denseSymbols;
+
+  // Bits of the functions with random IDs, valid for a bitmap of hashedBitsSize bits.
+  std::unordered_map<uint64_t, const char *> hashedBits;
+  uint64_t hashedBitsSize;
+
+  uint64_t slotSize() const noexcept {
+    return bitmap->size() / slots;
+  }
+
+  const uint8_t *slot(uint64_t index) const noexcept {
+    return bitmap->base() + index * slotSize();
+  }
+
+  uint64_t words() const noexcept {
+    return slotSize() / 8;
+  }
+
+  uint64_t MergedWord(uint64_t word) const noexcept {
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < slots; ++i) {
+      value |= LoadWord(slot(i), word);
+    }
+    return value;
+  }
+
+  /**
+   * Validate the bitmap layout after it has been mapped.
+   */
+  void CheckLayout() const {
+    if (bitmap->size() % (slots * 8) != 0) {
+      errno = EINVAL;
+      ThrowSystemError("bitmap size is not a multiple of 8 bytes per slot");
+    }
+  }
+
+  /**
+   * Attach to the module registry, or re-map it if it has grown. A missing or malformed registry is ignored; modules
+   * register themselves lazily, so the registry might show up later.
+   */
+  void LoadRegistry() noexcept {
+    try {
+      if (registry) {
+        registry->Reload();
+      } else {
+        registry = std::make_unique<Mapping>(registryName.c_str(), sharedMemory);
+      }
+    } catch (const std::system_error &) {
+      registry.reset();
+      return;
+    }
+
+    if (registry->size() < sizeof(llvm_covmap_registry)) {
+      registry.reset();
+      return;
+    }
+
+    auto header = reinterpret_cast<const llvm_covmap_registry *>(registry->base());
+    registryCapacity = (registry->size() - sizeof(llvm_covmap_registry)) / sizeof(llvm_covmap_module);
+    if (header->magic != LLVM_COVMAP_REGISTRY_MAGIC ||
+        header->version != LLVM_COVMAP_REGISTRY_VERSION ||
+        header->capacity > registryCapacity) {
+      registry.reset();
+    }
+  }
+
+  const llvm_covmap_registry *GetRegistry() const noexcept {
+    return registry ? reinterpret_cast<const llvm_covmap_registry *>(registry->base()) : nullptr;
+  }
+
+  const char *FindHashedSymbol(uint64_t bit) {
+    auto bits = slotSize() * 8;
+    if (bits == 0) {
+      return nullptr;
+    }
+
+    if (hashedBitsSize != bits) {
+      // Random function IDs are folded into the bitmap by the runtime, so their bits depend on the bitmap size.
+      hashedBits.clear();
+      for (const auto &symbol : hashedSymbols) {
+        hashedBits.emplace(symbol.first % bits, symbol.second);
+      }
+      hashedBitsSize = bits;
+    }
+
+    auto symbol = hashedBits.find(bit);
+    return symbol == hashedBits.end() ? nullptr : symbol->second;
+  }
+
+  /**
+   * Invoke the visitor for every completely registered module whose bits lie within the bitmap, in registration
+   * order, until the visitor returns nonzero.
+   *
+   * @return 0 after visiting all modules, or the nonzero value returned by the visitor.
+   */
+  template <typename Visitor>
+  int ForEachModule(Visitor visit) const {
+    auto header = GetRegistry();
+    if (!header) {
+      return 0;
+    }
+
+    auto count = std::min<uint64_t>(__atomic_load_n(&header->count, __ATOMIC_ACQUIRE), registryCapacity);
+    auto bits = slotSize() * 8;
+    for (uint64_t i = 0; i < count; ++i) {
+      const auto &module = header->modules[i];
+      if (!__atomic_load_n(&module.ready, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      // A module registered after the bitmap was mapped might not fit until the reader is reloaded.
+      if (module.base > bits || module.count > bits - module.base) {
+        continue;
+      }
+
+      auto ret = visit(module);
+      if (ret) {
+        return ret;
+      }
+    }
+
+    return 0;
+  }
+
+  const char *FindDenseSymbol(uint64_t bit) const noexcept {
+    const char *found = nullptr;
+    ForEachModule([this, bit, &found](const llvm_covmap_module &module) noexcept {
+      if (bit < module.base || bit - module.base >= module.count) {
+        return 0;
+      }
+
+      auto symbols = denseSymbols.find(module.id);
+      if (symbols == denseSymbols.end()) {
+        return 0;
+      }
+
+      auto index = bit - module.base;
+      if (index < symbols->second.size() && symbols->second[index]) {
+        found = symbols->second[index];
+        return 1;
+      }
+      return 0;
+    });
+    return found;
+  }
+};
+
+namespace {
+
+int OpenReader(const char *name, bool sharedMemory, uint64_t slots, llvm_covmap_reader **reader) noexcept {
+  if (!name || !reader) {
+    return -EINVAL;
+  }
+
+  try {
+    std::unique_ptr<llvm_covmap_reader> newReader { new llvm_covmap_reader { } };
+    newReader->bitmap = std::make_unique<Mapping>(name, sharedMemory);
+    newReader->registryName = std::string { name } + LLVM_COVMAP_REGISTRY_SUFFIX;
+    newReader->sharedMemory = sharedMemory;
+    newReader->slots = slots ? slots : 1;
+    newReader->hashedBitsSize = 0;
+    newReader->CheckLayout();
+    newReader->LoadRegistry();
+
+    *reader = newReader.release();
+    return 0;
+  } catch (...) {
+    return CurrentErrorCode();
+  }
+}
+
+} // namespace <anonymous>
+
+int llvm_covmap_reader_version(void) {
+  return LLVM_COVMAP_READER_VERSION;
+}
+
+int llvm_covmap_reader_open_shm(const char *name, uint64_t slots, llvm_covmap_reader **reader) {
+  return OpenReader(name, true, slots, reader);
+}
+
+int llvm_covmap_reader_open_file(const char *path, uint64_t slots, llvm_covmap_reader **reader) {
+  return OpenReader(path, false, slots, reader);
+}
+
+void llvm_covmap_reader_close(llvm_covmap_reader *reader) {
+  delete reader;
+}
+
+int llvm_covmap_reader_reload(llvm_covmap_reader *reader) {
+  try {
+    auto reloaded = reader->bitmap->Reload();
+    reader->CheckLayout();
+    reader->LoadRegistry();
+    return reloaded ? 1 : 0;
+  } catch (...) {
+    return CurrentErrorCode();
+  }
+}
+
+uint64_t llvm_covmap_reader_slots(const llvm_covmap_reader *reader) {
+  return reader->slots;
+}
+
+uint64_t llvm_covmap_reader_size(const llvm_covmap_reader *reader) {
+  return reader->slotSize();
+}
+
+const uint8_t *llvm_covmap_reader_bitmap(const llvm_covmap_reader *reader, uint64_t slot) {
+  return slot < reader->slots ? reader->slot(slot) : nullptr;
+}
+
+const llvm_covmap_registry *llvm_covmap_reader_registry(const llvm_covmap_reader *reader) {
+  return reader->GetRegistry();
+}
+
+int llvm_covmap_reader_foreach_module(
+    const llvm_covmap_reader *reader, llvm_covmap_visit_module_fn visit, void *context) {
+  return reader->ForEachModule([visit, context](const llvm_covmap_module &module) {
+    return visit(&module, context);
+  });
+}
+
+uint64_t llvm_covmap_reader_count(const llvm_covmap_reader *reader) {
+  if (!reader->bitmap->base()) {
+    return 0;
+  }
+  return CountMergedCoveredBits(reader->bitmap->base(), reader->slotSize(), reader->slots);
+}
+
+uint64_t llvm_covmap_reader_count_slot(const llvm_covmap_reader *reader, uint64_t slot) {
+  if (slot >= reader->slots || !reader->bitmap->base()) {
+    return 0;
+  }
+  return CountCoveredBits(reader->slot(slot), reader->slotSize());
+}
+
+uint64_t llvm_covmap_reader_count_range(const llvm_covmap_reader *reader, uint64_t begin, uint64_t end) {
+  auto bits = reader->slotSize() * 8;
+  if (end > bits) {
+    end = bits;
+  }
+  if (begin >= end) {
+    return 0;
+  }
+
+  if (reader->slots == 1) {
+    return CountCoveredBitsInRange(reader->slot(0), begin, end);
+  }
+
+  auto firstWord = begin / 64;
+  auto lastWord = (end - 1) / 64;
+  auto firstMask = ~0ull << (begin % 64);
+  auto lastMask = ~0ull >> (63 - (end - 1) % 64);
+
+  uint64_t covered = 0;
+  for (auto word = firstWord; word <= lastWord; ++word) {
+    auto value = reader->MergedWord(word);
+    if (word == firstWord) {
+      value &= firstMask;
+    }
+    if (word == lastWord) {
+      value &= lastMask;
+    }
+    covered += __builtin_popcountll(value);
+  }
+
+  return covered;
+}
+
+int llvm_covmap_reader_test(const llvm_covmap_reader *reader, uint64_t bit) {
+  if (bit >= reader->slotSize() * 8) {
+    return 0;
+  }
+
+  for (uint64_t i = 0; i < reader->slots; ++i) {
+    if (reader->slot(i)[bit / 8] & (1u << (bit % 8))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int llvm_covmap_reader_foreach(const llvm_covmap_reader *reader, llvm_covmap_visit_fn visit, void *context) {
+  auto words = reader->words();
+  for (uint64_t word = 0; word < words; ++word) {
+    auto ret = VisitWord(word, reader->MergedWord(word), visit, context);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int llvm_covmap_reader_count_op(
+    const llvm_covmap_reader *lhs, const llvm_covmap_reader *rhs, llvm_covmap_set_op op, uint64_t *count) {
+  if (lhs->slotSize() != rhs->slotSize() || !IsValidSetOp(op)) {
+    return -EINVAL;
+  }
+
+  uint64_t covered = 0;
+  auto words = lhs->words();
+  for (uint64_t word = 0; word < words; ++word) {
+    covered += __builtin_popcountll(CombineWords(lhs->MergedWord(word), rhs->MergedWord(word), op));
+  }
+
+  *count = covered;
+  return 0;
+}
+
+int llvm_covmap_reader_foreach_op(
+    const llvm_covmap_reader *lhs, const llvm_covmap_reader *rhs, llvm_covmap_set_op op,
+    llvm_covmap_visit_fn visit, void *context) {
+  if (lhs->slotSize() != rhs->slotSize() || !IsValidSetOp(op)) {
+    return -EINVAL;
+  }
+
+  auto words = lhs->words();
+  for (uint64_t word = 0; word < words; ++word) {
+    auto value = CombineWords(lhs->MergedWord(word), rhs->MergedWord(word), op);
+    auto ret = VisitWord(word, value, visit, context);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int llvm_covmap_reader_snapshot(const llvm_covmap_reader *reader, const char *path) {
+  if (!path) {
+    return -EINVAL;
+  }
+
+  try {
+    std::string bitmapPath { path };
+    if (reader->registry) {
+      // Write the registry first, so that a snapshot bitmap never refers to modules missing from its registry.
+      WriteFileAtomically(bitmapPath + LLVM_COVMAP_REGISTRY_SUFFIX, reader->registry->base(), reader->registry->size());
+    }
+    WriteFileAtomically(bitmapPath, reader->bitmap->base(), reader->bitmap->size());
+    return 0;
+  } catch (...) {
+    return CurrentErrorCode();
+  }
+}
+
+int llvm_covmap_reader_load_symbols(llvm_covmap_reader *reader, const char *path) {
+  if (!path) {
+    return -EINVAL;
+  }
+
+  try {
+    std::ifstream file { path };
+    if (!file) {
+      return errno ? -errno : -ENOENT;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+      // Each line is either "hash <id> <symbol>" or "dense <module id> <index> <symbol> <source file>", separated by
+      // tabs. The source file is informational only.
+      std::vector<std::string> fields;
+      size_t start = 0;
+      while (fields.size() < 4) {
+        auto end = line.find('\t', start);
+        if (end == std::string::npos) {
+          break;
+        }
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+      }
+      fields.push_back(line.substr(start));
+
+      char *end = nullptr;
+      if (fields[0] == "hash" && fields.size() == 3) {
+        errno = 0;
+        auto id = std::strtoull(fields[1].c_str(), &end, 10);
+        if (errno || *end) {
+          return -EINVAL;
+        }
+        reader->symbolNames.push_back(fields[2]);
+        reader->hashedSymbols[id] = reader->symbolNames.back().c_str();
+        reader->hashedBitsSize = 0;
+      } else if (fields[0] == "dense" && fields.size() == 5) {
+        errno = 0;
+        auto moduleId = std::strtoull(fields[1].c_str(), &end, 10);
+        if (errno || *end) {
+          return -EINVAL;
+        }
+        auto index = std::strtoull(fields[2].c_str(), &end, 10);
+        if (errno || *end) {
+          return -EINVAL;
+        }
+        reader->symbolNames.push_back(fields[3]);
+        auto &symbols = reader->denseSymbols[moduleId];
+        if (symbols.size() <= index) {
+          symbols.resize(index + 1, nullptr);
+        }
+        symbols[index] = reader->symbolNames.back().c_str();
+      } else if (fields[0] == "hash" || fields[0] == "dense") {
+        return -EINVAL;
+      }
+      // Lines of unknown kinds are left for newer readers.
+    }
+
+    return 0;
+  } catch (...) {
+    return CurrentErrorCode();
+  }
+}
+
+const char *llvm_covmap_reader_symbol(llvm_covmap_reader *reader, uint64_t bit) {
+  try {
+    auto symbol = reader->FindDenseSymbol(bit);
+    return symbol ? symbol : reader->FindHashedSymbol(bit);
+  } catch (...) {
+    return nullptr;
+  }
+}
@@ -5,6 +5,8 @@
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "bugprone-reserved-identifier"
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
@@ -13,25 +15,100 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "llvm-covmap/Runtime/Control.h"
+#include "llvm-covmap/Runtime/ModuleRegistry.h"
+
 #define DEFAULT_SHARED_MEMORY_SIZE (1024 * 1024)
+#define DEFAULT_MAX_SHARED_MEMORY_SIZE (256 * 1024 * 1024)
+#define DEFAULT_FORK_SLOTS 1
+#define DEFAULT_REGISTRY_CAPACITY 16384
+
+// How long to wait for another process to initialize the module registry it has just created.
+#define REGISTRY_INIT_TIMEOUT_MS 5000
+
+// Exported by the runtime so that programs started through exec by an instrumented process join the region of their
+// ancestor instead of taking it over. The owner is exported as "<pid>:<region name>".
+#define OWNER_ENV_NAME "LLVM_COVMAP_OWNER"
+#define SLOT_ENV_NAME "LLVM_COVMAP_SLOT"
 
 static pthread_mutex_t mountMutex = PTHREAD_MUTEX_INITIALIZER;
 
+// The slot that the next forked child will occupy. Only meaningful in the process owning slot 0.
+static size_t nextForkSlot;
+static size_t pendingForkSlot;
+
 const char *__llvm_covmap_shm_name;
 int __llvm_covmap_disabled;
 int __llvm_covmap_fd;
 uint8_t *__llvm_covmap;
 size_t __llvm_covmap_size;
 
+// The whole shared memory region, which holds __llvm_covmap_slots bitmaps of __llvm_covmap_size bytes each.
+uint8_t *__llvm_covmap_base;
+size_t __llvm_covmap_slots;
+size_t __llvm_covmap_slot;
+
+// The size of the address space reserved for the shared memory region, which bounds how far the bitmap can grow.
+size_t __llvm_covmap_capacity;
+
+// The process that mounted the shared memory region and is responsible for unlinking it.
+pid_t __llvm_covmap_owner;
+
+char *__llvm_covmap_registry_name;
+struct llvm_covmap_registry *__llvm_covmap_registry;
+
+// The guard bytes of one-shot probes registered by instrumented modules.
+struct GuardRange {
+  uint8_t *guards;
+  uint64_t count;
+};
+
+static struct GuardRange *guardRanges;
+static size_t guardRangeCount;
+static size_t guardRangeCapacity;
+
+// The generation of the control block at which the guards were last re-armed.
+static uint32_t armedGeneration;
+
+// Every probe tests the control word in this page, which sits at a fixed address so that the test is a single load.
+// Until the bitmap is mounted the page is private and zero, which sends probes to the slow path that mounts the bitmap;
+// MountControl then maps the shared control block over the page. Once the runtime is disabled for good, a private zero
+// page is mapped over it again. The page is aligned to the largest page size of the supported targets.
+#define CONTROL_PAGE_SIZE 65536
+
+static union {
+  struct llvm_covmap_control control;
+  uint8_t bytes[CONTROL_PAGE_SIZE];
+} controlPage __attribute__((aligned(CONTROL_PAGE_SIZE)));
+
+static int controlMapped;
+
+char *__llvm_covmap_control_name;
+struct llvm_covmap_control *const __llvm_covmap_control = &controlPage.control;
+
+static void Disable() {
+  __llvm_covmap_disabled = 1;
+  if (controlMapped) {
+    // Failing to unmap the shared control block leaves the probes subject to it, which is still safe.
+    mmap(&controlPage, (size_t)sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    controlMapped = 0;
+  }
+}
+
 __attribute__((noreturn))
 static void FatalError(const char *function, int errorCode) {
-  __llvm_covmap_disabled = 1;
+  Disable();
   fprintf(stderr, "llvm-covmap: %s failed: %d: %s\n", function, errorCode, strerror(errorCode));
   abort();
 }
@@ -52,8 +129,149 @@ static size_t GetSharedMemorySize() {
   return sharedMemorySize;
 }
 
+static size_t GetMaxSharedMemorySize() {
+  const char *maxSharedMemorySizeStr = getenv("LLVM_COVMAP_SHM_MAX_SIZE");
+  if (!maxSharedMemorySizeStr) {
+    return DEFAULT_MAX_SHARED_MEMORY_SIZE;
+  }
+
+  errno = 0;
+  size_t maxSharedMemorySize = strtoul(maxSharedMemorySizeStr, NULL, 10);
+  if (errno != 0) {
+    return DEFAULT_MAX_SHARED_MEMORY_SIZE;
+  }
+
+  return maxSharedMemorySize & ~(size_t)7;
+}
+
+static size_t GetRegistryCapacity() {
+  const char *capacityStr = getenv("LLVM_COVMAP_REGISTRY_CAPACITY");
+  if (!capacityStr) {
+    return DEFAULT_REGISTRY_CAPACITY;
+  }
+
+  errno = 0;
+  size_t capacity = strtoul(capacityStr, NULL, 10);
+  if (errno != 0 || capacity == 0) {
+    return DEFAULT_REGISTRY_CAPACITY;
+  }
+
+  return capacity;
+}
+
+static size_t GetForkSlots() {
+  const char *forkSlotsStr = getenv("LLVM_COVMAP_FORK_SLOTS");
+  if (!forkSlotsStr) {
+    return DEFAULT_FORK_SLOTS;
+  }
+
+  errno = 0;
+  size_t forkSlots = strtoul(forkSlotsStr, NULL, 10);
+  if (errno != 0 || forkSlots == 0) {
+    return DEFAULT_FORK_SLOTS;
+  }
+
+  return forkSlots;
+}
+
+/**
+ * Get the process owning the given region as exported by an ancestor of this process.
+ *
+ * @return the pid of the owner, or 0 if this process should own the region: no ancestor exported an owner of this
+ * region, the owner has exited, or this process is the owner that has executed another program.
+ */
+static pid_t GetInheritedOwner(const char *shmName) {
+  const char *ownerStr = getenv(OWNER_ENV_NAME);
+  if (!ownerStr) {
+    return 0;
+  }
+
+  // An ancestor recording into another region is not the owner of this one.
+  char *nameStr;
+  errno = 0;
+  pid_t owner = (pid_t)strtol(ownerStr, &nameStr, 10);
+  if (errno != 0 || nameStr == ownerStr || *nameStr != ':' || strcmp(nameStr + 1, shmName) != 0) {
+    return 0;
+  }
+  if (owner <= 0 || owner == getpid()) {
+    return 0;
+  }
+
+  if (kill(owner, 0) == -1 && errno == ESRCH) {
+    return 0;
+  }
+  return owner;
+}
+
+static size_t GetInheritedSlot() {
+  const char *slotStr = getenv(SLOT_ENV_NAME);
+  if (!slotStr) {
+    return 0;
+  }
+
+  errno = 0;
+  size_t slot = strtoul(slotStr, NULL, 10);
+  if (errno != 0) {
+    return 0;
+  }
+
+  return slot;
+}
+
+static void ExportNumber(const char *name, unsigned long value) {
+  char valueStr[32];
+  snprintf(valueStr, sizeof(valueStr), "%lu", value);
+  if (setenv(name, valueStr, 1) == -1) {
+    FatalError("setenv", errno);
+  }
+}
+
+/**
+ * Export this process as the owner of its region, unless it joins the region of an ancestor. Must only be called while
+ * no other thread can read the environment, since setenv races with getenv.
+ */
+static void ExportOwner() {
+  const char *shmName = getenv("LLVM_COVMAP_SHM_NAME");
+  if (!shmName || GetInheritedOwner(shmName)) {
+    return;
+  }
+
+  int ownerLength = snprintf(NULL, 0, "%ld:%s", (long)getpid(), shmName);
+  char *ownerStr = (char *)malloc((size_t)ownerLength + 1);
+  if (!ownerStr) {
+    FatalError("malloc", ENOMEM);
+  }
+  snprintf(ownerStr, (size_t)ownerLength + 1, "%ld:%s", (long)getpid(), shmName);
+  if (setenv(OWNER_ENV_NAME, ownerStr, 1) == -1) {
+    FatalError("setenv", errno);
+  }
+  free(ownerStr);
+
+  unsetenv(SLOT_ENV_NAME);
+}
+
+/**
+ * Get the name of a shared memory object that accompanies the bitmap.
+ */
+static char *GetCompanionName(const char *suffix) {
+  size_t nameLength = strlen(__llvm_covmap_shm_name) + strlen(suffix) + 1;
+  char *name = (char *)malloc(nameLength);
+  if (!name) {
+    FatalError("malloc", ENOMEM);
+  }
+  snprintf(name, nameLength, "%s%s", __llvm_covmap_shm_name, suffix);
+  return name;
+}
+
 static void UnlinkSharedMemory() {
-  if (__llvm_covmap_disabled || !__llvm_covmap) {
+  // The runtime might have been disabled after mounting the region, which then still needs to be unlinked.
+  if (!__llvm_covmap_base) {
+    return;
+  }
+
+  // Forked children inherit both the mapping and this atexit handler, but the region belongs to the process that
+  // mounted it.
+  if (getpid() != __llvm_covmap_owner) {
     return;
   }
 
@@ -62,29 +280,152 @@ static void UnlinkSharedMemory() {
   // the bitmap.
 
   shm_unlink(__llvm_covmap_shm_name);
+  if (__llvm_covmap_control_name) {
+    shm_unlink(__llvm_covmap_control_name);
+  }
+
+  // Modules might have been registered by other processes sharing the region only, so the registry is unlinked even if
+  // this process has never mounted it. Otherwise the next run would adopt the stale assignments.
+  if (!__llvm_covmap_registry_name) {
+    __llvm_covmap_registry_name = GetCompanionName(LLVM_COVMAP_REGISTRY_SUFFIX);
+  }
+  shm_unlink(__llvm_covmap_registry_name);
+}
+
+static size_t GetSharedMemoryObjectSize(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    FatalError("fstat", errno);
+  }
+  return (size_t)st.st_size;
+}
+
+static int IsStartDisabled() {
+  const char *startDisabledStr = getenv("LLVM_COVMAP_START_DISABLED");
+  return startDisabledStr && *startDisabledStr && strcmp(startDisabledStr, "0") != 0;
+}
+
+/**
+ * Map the shared control block over the control page.
+ *
+ * @param owner nonzero if this process owns the region, as opposed to joining the region of another process.
+ */
+static void MountControl(int owner) {
+  __llvm_covmap_control_name = GetCompanionName(LLVM_COVMAP_CONTROL_SUFFIX);
+
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  if (pageSize > CONTROL_PAGE_SIZE) {
+    FatalError("MountControl", EINVAL);
+  }
+
+  // A utility might have created the control block before the program started, in which case its state is kept.
+  int created = 1;
+  int fd = shm_open(__llvm_covmap_control_name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if (fd == -1 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(__llvm_covmap_control_name, O_RDWR, 0);
+  }
+  if (fd == -1) {
+    FatalError("shm_open", errno);
+  }
+
+  if (GetSharedMemoryObjectSize(fd) < sizeof(struct llvm_covmap_control) &&
+      ftruncate(fd, sizeof(struct llvm_covmap_control)) == -1) {
+    FatalError("ftruncate64", errno);
+  }
+
+  // Set up the word before the probes can see it.
+  if (created) {
+    struct llvm_covmap_control control = {
+        .word = IsStartDisabled() ? 0 : LLVM_COVMAP_CONTROL_ENABLED,
+        .generation = 0,
+    };
+    if (pwrite(fd, &control, sizeof(control), 0) != sizeof(control)) {
+      FatalError("pwrite", errno);
+    }
+  }
+
+  void *sharedMemory = mmap(&controlPage, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  if (sharedMemory == MAP_FAILED) {
+    FatalError("mmap", errno);
+  }
+  close(fd);
+  controlMapped = 1;
+
+  // A control block left behind by a killed run, or switched off by a utility earlier, keeps the program from recording
+  // anything. That is intended when collection is switched on later, but should not go unnoticed.
+  if (owner && !created && !IsStartDisabled() &&
+      !(__atomic_load_n(&controlPage.control.word, __ATOMIC_RELAXED) & LLVM_COVMAP_CONTROL_ENABLED)) {
+    fprintf(stderr, "llvm-covmap: coverage collection starts switched off by the existing control block %s\n",
+            __llvm_covmap_control_name);
+  }
 }
 
 static void MountBitmap() {
-  __llvm_covmap_shm_name = getenv("LLVM_COVMAP_SHM_NAME");
-  if (!__llvm_covmap_shm_name) {
-    __llvm_covmap_disabled = 1;
+  const char *shmName = getenv("LLVM_COVMAP_SHM_NAME");
+  if (!shmName) {
+    Disable();
     return;
   }
 
+  // The program might change its environment before the name is needed again to unlink the bitmap.
+  __llvm_covmap_shm_name = strdup(shmName);
+  if (!__llvm_covmap_shm_name) {
+    FatalError("strdup", ENOMEM);
+  }
+
   __llvm_covmap_fd = shm_open(__llvm_covmap_shm_name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
   if (__llvm_covmap_fd == -1) {
     FatalError("shm_open", errno);
   }
 
+  // A program executed by a process sharing the region records into the slot of that process and leaves the region
+  // to its owner.
+  pid_t inheritedOwner = GetInheritedOwner(__llvm_covmap_shm_name);
+  if (inheritedOwner) {
+    __llvm_covmap_slot = GetInheritedSlot();
+  }
+
   __llvm_covmap_size = GetSharedMemorySize();
-  if (ftruncate(__llvm_covmap_fd, __llvm_covmap_size) == -1) {
+  __llvm_covmap_slots = GetForkSlots();
+  if (__llvm_covmap_slot >= __llvm_covmap_slots) {
+    __llvm_covmap_slot = 0;
+  }
+
+  size_t regionSize = __llvm_covmap_size * __llvm_covmap_slots;
+
+  // A single bitmap can grow on demand when modules register themselves. Reserve the address space for the largest
+  // possible bitmap up front and map the shared memory object into the beginning of it, so that growing the bitmap
+  // never moves it while other threads are writing into it.
+  __llvm_covmap_capacity = regionSize;
+  if (__llvm_covmap_slots == 1 && GetMaxSharedMemorySize() > regionSize) {
+    __llvm_covmap_capacity = GetMaxSharedMemorySize();
+  }
+
+  // Another process sharing the bitmap might have grown it already. Never shrink the bitmap under its feet.
+  size_t existingSize = GetSharedMemoryObjectSize(__llvm_covmap_fd);
+  if (__llvm_covmap_slots == 1 && existingSize > regionSize) {
+    regionSize = existingSize < __llvm_covmap_capacity ? existingSize & ~(size_t)7 : __llvm_covmap_capacity;
+    __llvm_covmap_size = regionSize;
+  }
+
+  if (existingSize < regionSize && ftruncate(__llvm_covmap_fd, regionSize) == -1) {
     int errorCode = errno;
     close(__llvm_covmap_fd);
     shm_unlink(__llvm_covmap_shm_name);
     FatalError("ftruncate64", errorCode);
   }
 
-  void* sharedMemory = mmap(NULL, __llvm_covmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, __llvm_covmap_fd, 0);
+  void *reserved = mmap(NULL, __llvm_covmap_capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    int errorCode = errno;
+    close(__llvm_covmap_fd);
+    shm_unlink(__llvm_covmap_shm_name);
+    FatalError("mmap", errorCode);
+  }
+
+  void* sharedMemory = mmap(reserved, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                            __llvm_covmap_fd, 0);
   if (sharedMemory == MAP_FAILED) {
     int errorCode = errno;
     close(__llvm_covmap_fd);
@@ -92,48 +433,512 @@ static void MountBitmap() {
     FatalError("mmap", errorCode);
   }
 
-  __llvm_covmap = (uint8_t *)sharedMemory;
+  __llvm_covmap_base = (uint8_t *)sharedMemory;
+  __atomic_store_n(&__llvm_covmap, __llvm_covmap_base + __llvm_covmap_slot * __llvm_covmap_size, __ATOMIC_RELEASE);
+  __llvm_covmap_owner = inheritedOwner ? inheritedOwner : getpid();
+
+  // Probes only record once the control block is mapped, so the bitmap is published first. Until then, probes see
+  // collection switched off.
+  MountControl(!inheritedOwner);
 
   atexit(UnlinkSharedMemory);
 }
 
+/**
+ * Grow the bitmap to at least the given size, in bytes. Must be called with mountMutex held.
+ *
+ * @return nonzero if the bitmap is now large enough.
+ */
+static int GrowBitmap(size_t size) {
+  size_t oldSize = __llvm_covmap_size;
+  if (size <= oldSize) {
+    return 1;
+  }
+  if (__llvm_covmap_slots != 1 || size > __llvm_covmap_capacity) {
+    return 0;
+  }
+
+  size_t newSize = oldSize ? oldSize : 8;
+  while (newSize < size) {
+    newSize *= 2;
+  }
+  if (newSize > __llvm_covmap_capacity) {
+    newSize = __llvm_covmap_capacity;
+  }
+
+  size_t existingSize = GetSharedMemoryObjectSize(__llvm_covmap_fd);
+  if (existingSize > newSize) {
+    newSize = existingSize < __llvm_covmap_capacity ? existingSize & ~(size_t)7 : __llvm_covmap_capacity;
+  } else if (existingSize < newSize && ftruncate(__llvm_covmap_fd, newSize) == -1) {
+    FatalError("ftruncate64", errno);
+  }
+
+  // Map the tail of the object, starting from the page that contains the current end of the bitmap. Replacing that
+  // page maps the very same shared page again, so concurrent writers are not affected.
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t offset = oldSize & ~(pageSize - 1);
+  void *tail = mmap(__llvm_covmap_base + offset, newSize - offset, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    __llvm_covmap_fd, (off_t)offset);
+  if (tail == MAP_FAILED) {
+    FatalError("mmap", errno);
+  }
+
+  __atomic_store_n(&__llvm_covmap_size, newSize, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void InitializeRegistryLock(pthread_mutex_t *lock) {
+  pthread_mutexattr_t attr;
+  int errorCode = pthread_mutexattr_init(&attr);
+  if (!errorCode) {
+    errorCode = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  }
+  if (!errorCode) {
+    // A process that dies while registering a module must not block all other processes sharing the registry.
+    errorCode = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+  if (!errorCode) {
+    errorCode = pthread_mutex_init(lock, &attr);
+  }
+  if (errorCode) {
+    FatalError("pthread_mutex_init", errorCode);
+  }
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void LockRegistry(struct llvm_covmap_registry *registry) {
+  int errorCode = pthread_mutex_lock(&registry->lock);
+  if (errorCode == EOWNERDEAD) {
+    // The previous holder died before publishing its entry, which then never becomes ready. The rest of the registry
+    // is consistent.
+    errorCode = pthread_mutex_consistent(&registry->lock);
+  }
+  if (errorCode) {
+    FatalError("pthread_mutex_lock", errorCode);
+  }
+}
+
+static void UnlockRegistry(struct llvm_covmap_registry *registry) {
+  int errorCode = pthread_mutex_unlock(&registry->lock);
+  if (errorCode) {
+    FatalError("pthread_mutex_unlock", errorCode);
+  }
+}
+
+/**
+ * Wait until the process that created the registry has initialized its header.
+ *
+ * @return the capacity of the registry, or 0 if the registry cannot be used: its creator died before initializing it,
+ * or it has been created by an incompatible runtime.
+ */
+static size_t WaitForRegistry(int fd) {
+  struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+  for (int elapsed = 0; elapsed < REGISTRY_INIT_TIMEOUT_MS; ++elapsed) {
+    struct llvm_covmap_registry header;
+    if (GetSharedMemoryObjectSize(fd) >= sizeof(header) &&
+        pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        header.magic == LLVM_COVMAP_REGISTRY_MAGIC) {
+      if (header.version != LLVM_COVMAP_REGISTRY_VERSION) {
+        fprintf(stderr, "llvm-covmap: module registry %s has version %llu instead of %d, "
+                        "coverage collection is disabled\n",
+                __llvm_covmap_registry_name, (unsigned long long)header.version, LLVM_COVMAP_REGISTRY_VERSION);
+        return 0;
+      }
+      // The creator sizes the object before publishing the header.
+      size_t objectSize = GetSharedMemoryObjectSize(fd);
+      if (header.capacity == 0 ||
+          header.capacity > (objectSize - sizeof(header)) / sizeof(struct llvm_covmap_module)) {
+        fprintf(stderr, "llvm-covmap: module registry %s is malformed, coverage collection is disabled\n",
+                __llvm_covmap_registry_name);
+        return 0;
+      }
+      return header.capacity;
+    }
+    nanosleep(&delay, NULL);
+  }
+
+  fprintf(stderr, "llvm-covmap: module registry %s has not been initialized by its creator, "
+                  "coverage collection is disabled\n", __llvm_covmap_registry_name);
+  return 0;
+}
+
+static void MountRegistry() {
+  if (!__llvm_covmap_registry_name) {
+    __llvm_covmap_registry_name = GetCompanionName(LLVM_COVMAP_REGISTRY_SUFFIX);
+  }
+
+  // Processes sharing the bitmap share the registry as well. The process creating it initializes the header, while the
+  // others wait for the header to be published.
+  int created = 1;
+  int fd = shm_open(__llvm_covmap_registry_name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if (fd == -1 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(__llvm_covmap_registry_name, O_RDWR, 0);
+  }
+  if (fd == -1) {
+    FatalError("shm_open", errno);
+  }
+
+  // A stale registry left behind by a killed process must not take down every later process sharing its name, so the
+  // runtime is disabled rather than aborting. The owner of the region unlinks the registry when it exits.
+  size_t capacity = created ? GetRegistryCapacity() : WaitForRegistry(fd);
+  if (!capacity) {
+    close(fd);
+    Disable();
+    return;
+  }
+
+  size_t registrySize = sizeof(struct llvm_covmap_registry) + capacity * sizeof(struct llvm_covmap_module);
+  if (created && ftruncate(fd, registrySize) == -1) {
+    FatalError("ftruncate64", errno);
+  }
+
+  void *sharedMemory = mmap(NULL, registrySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sharedMemory == MAP_FAILED) {
+    FatalError("mmap", errno);
+  }
+  close(fd);
+
+  struct llvm_covmap_registry *registry = (struct llvm_covmap_registry *)sharedMemory;
+  if (created) {
+    registry->version = LLVM_COVMAP_REGISTRY_VERSION;
+    registry->capacity = capacity;
+    InitializeRegistryLock(&registry->lock);
+    __atomic_store_n(&registry->magic, LLVM_COVMAP_REGISTRY_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  __llvm_covmap_registry = registry;
+}
+
+static uint64_t HashModuleIdentity(const char *objectPath, const char *moduleName) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const char *parts[3] = { objectPath, ":", moduleName };
+  for (size_t i = 0; i < 3; ++i) {
+    for (const unsigned char *p = (const unsigned char *)parts[i]; *p; ++p) {
+      hash ^= *p;
+      hash *= 0x100000001b3ull;
+    }
+  }
+  return hash;
+}
+
+static uint64_t RegisterModule(const char *moduleName, uint64_t moduleId, uint64_t functionCount,
+                               const void *moduleAddress) {
+  struct llvm_covmap_registry *registry = __llvm_covmap_registry;
+
+  char name[LLVM_COVMAP_MODULE_NAME_SIZE] = { 0 };
+  char objectPath[PATH_MAX] = { 0 };
+  Dl_info info;
+  if (dladdr(moduleAddress, &info) && info.dli_fname && info.dli_fname[0]) {
+    if (!realpath(info.dli_fname, objectPath)) {
+      strncpy(objectPath, info.dli_fname, sizeof(objectPath) - 1);
+    }
+    char baseName[PATH_MAX];
+    memcpy(baseName, objectPath, sizeof(baseName));
+    snprintf(name, sizeof(name), "%s:%s", basename(baseName), moduleName);
+  } else {
+    snprintf(name, sizeof(name), "%s", moduleName);
+  }
+  uint64_t hash = HashModuleIdentity(objectPath, moduleName);
+
+  LockRegistry(registry);
+
+  // A shared object that is loaded again after being unloaded, or by another process sharing the registry, gets its
+  // previous range back.
+  uint64_t base = 0;
+  int found = 0;
+  uint64_t count = registry->count < registry->capacity ? registry->count : registry->capacity;
+  for (uint64_t i = 0; i < count; ++i) {
+    struct llvm_covmap_module *module = &registry->modules[i];
+    if (module->ready && module->hash == hash && module->id == moduleId && module->count == functionCount) {
+      base = module->base;
+      found = 1;
+      break;
+    }
+  }
+
+  if (!found) {
+    base = registry->next_bit;
+    __atomic_store_n(&registry->next_bit, base + functionCount, __ATOMIC_RELEASE);
+
+    uint64_t index = registry->count;
+    if (index < registry->capacity) {
+      struct llvm_covmap_module *module = &registry->modules[index];
+      module->base = base;
+      module->count = functionCount;
+      module->id = moduleId;
+      module->hash = hash;
+      memcpy(module->name, name, sizeof(name));
+      __atomic_store_n(&registry->count, index + 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&module->ready, 1, __ATOMIC_RELEASE);
+    } else {
+      fprintf(stderr, "llvm-covmap: module registry is full, module %s will not be reported\n", name);
+    }
+  }
+
+  UnlockRegistry(registry);
+
+  // Another process might have grown the bitmap for this range, but the mapping of this process must cover it as well.
+  // Otherwise the function IDs of the module would wrap around into the ranges of other modules.
+  size_t requiredSize = ((base + functionCount + 63) / 64) * 8;
+  if (!GrowBitmap(requiredSize)) {
+    fprintf(stderr, "llvm-covmap: cannot grow the coverage bitmap to %zu bytes for module %s, "
+                    "coverage collection is disabled\n", requiredSize, name);
+    Disable();
+  }
+
+  return base;
+}
+
+static void PrepareFork() {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+
+  // Mount the bitmap before forking so that the region is owned, and eventually unlinked, by the parent instead of
+  // whichever child happens to hit a function first.
+  if (!__llvm_covmap_disabled && !__llvm_covmap) {
+    MountBitmap();
+  }
+
+  size_t slots = __llvm_covmap_slots;
+  if (slots <= 1 || __llvm_covmap_slot != 0) {
+    // Grandchildren are attributed to the child that forked them.
+    pendingForkSlot = __llvm_covmap_slot;
+    return;
+  }
+
+  // Slots are recycled once all of them have been handed out, so long-running pre-fork servers that respawn workers
+  // keep a bounded region.
+  pendingForkSlot = 1 + nextForkSlot++ % (slots - 1);
+}
+
+static void ParentAfterFork() {
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+static void ChildAfterFork() {
+  if (pendingForkSlot != __llvm_covmap_slot) {
+    // The child records into a fresh slot, so the functions already recorded by the parent must be recorded again.
+    for (size_t i = 0; i < guardRangeCount; ++i) {
+      memset(guardRanges[i].guards, 0, guardRanges[i].count);
+    }
+  }
+
+  __llvm_covmap_slot = pendingForkSlot;
+  if (__llvm_covmap_base) {
+    __llvm_covmap = __llvm_covmap_base + __llvm_covmap_slot * __llvm_covmap_size;
+  }
+
+  // Let a program executed by this child record into the slot of the child. The child has a single thread, so nothing
+  // can read the environment concurrently.
+  if (__llvm_covmap_slots > 1) {
+    ExportNumber(SLOT_ENV_NAME, (unsigned long)__llvm_covmap_slot);
+  }
+
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+__attribute__((constructor))
+static void InitializeRuntime() {
+  int errorCode = pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+  if (errorCode) {
+    FatalError("pthread_atfork", errorCode);
+  }
+
+  // The environment is only changed here, before the program starts its threads, and in forked children.
+  ExportOwner();
+}
+
 __attribute__((always_inline))
 static inline void SetBitmap(uint64_t functionId) {
   uint64_t offset = functionId % (__llvm_covmap_size * CHAR_BIT);
   __llvm_covmap[offset >> 3] |= (1u << (offset & 7));
 }
 
-void __llvm_covmap_hit_function(uint64_t functionId) {
+static void MountBitmapIfNeeded() {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+  if (!__llvm_covmap && !__llvm_covmap_disabled) {
+    MountBitmap();
+  }
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+/**
+ * Record a hit to the given function while collection is switched off or the bitmap has not been mounted yet.
+ */
+__attribute__((noinline))
+static int HitFunctionSlow(uint64_t functionId) {
+  if (__llvm_covmap || __llvm_covmap_disabled) {
+    return __llvm_covmap_disabled;
+  }
+
+  MountBitmapIfNeeded();
   if (__llvm_covmap_disabled) {
-    return;
+    return 1;
   }
 
-  // if (!__llvm_covmap)
-  if (__builtin_expect(__llvm_covmap == NULL, 0)) {
-    if (pthread_mutex_lock(&mountMutex)) {
-      FatalError("pthread_mutex_lock", errno);
-    }
+  // The program might have been started with collection switched off.
+  if (!(__atomic_load_n(&controlPage.control.word, __ATOMIC_RELAXED) & LLVM_COVMAP_CONTROL_ENABLED)) {
+    return 0;
+  }
 
-    if (__llvm_covmap_disabled) {
-      if (pthread_mutex_unlock(&mountMutex)) {
-        FatalError("pthread_mutex_unlock", errno);
-      }
-      return;
+  SetBitmap(functionId);
+  return 1;
+}
+
+/**
+ * Record a hit to the given function.
+ *
+ * @return zero if collection is currently switched off through the control block.
+ */
+__attribute__((always_inline))
+static inline int HitFunction(uint64_t functionId) {
+  if (__builtin_expect(!(__atomic_load_n(&controlPage.control.word, __ATOMIC_RELAXED) & LLVM_COVMAP_CONTROL_ENABLED),
+                       0)) {
+    return HitFunctionSlow(functionId);
+  }
+
+  SetBitmap(functionId);
+  return 1;
+}
+
+/**
+ * Clear the guards of all one-shot probes if collection has been switched on since they were last cleared, so that
+ * the functions called while collection was switched off are recorded by their next call.
+ */
+static void RearmGuards(uint32_t generation) {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+
+  if (generation != __atomic_load_n(&armedGeneration, __ATOMIC_RELAXED)) {
+    for (size_t i = 0; i < guardRangeCount; ++i) {
+      memset(guardRanges[i].guards, 0, guardRanges[i].count);
     }
+    __atomic_store_n(&armedGeneration, generation, __ATOMIC_RELAXED);
+  }
 
-    if (!__llvm_covmap) {
-      MountBitmap();
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+/**
+ * Record a hit to a function with a one-shot probe while collection is switched off, the bitmap has not been mounted
+ * yet, or the guards need to be re-armed.
+ */
+__attribute__((noinline))
+static void HitFunctionOnceSlow(uint64_t functionId, uint8_t *guard) {
+  if (!__llvm_covmap && !__llvm_covmap_disabled) {
+    MountBitmapIfNeeded();
+  }
+
+  if (!__llvm_covmap_disabled) {
+    uint32_t generation = __atomic_load_n(&controlPage.control.generation, __ATOMIC_RELAXED);
+    if (generation != __atomic_load_n(&armedGeneration, __ATOMIC_RELAXED)) {
+      RearmGuards(generation);
     }
-    if (pthread_mutex_unlock(&mountMutex)) {
-      FatalError("pthread_mutex_unlock", errno);
+    if (__atomic_load_n(&controlPage.control.word, __ATOMIC_RELAXED) & LLVM_COVMAP_CONTROL_ENABLED) {
+      SetBitmap(functionId);
     }
+  }
 
-    if (__llvm_covmap_disabled) {
-      return;
-    }
+  // While collection is switched off the guard is set as well, so that a paused program does not call into the
+  // runtime on every call of the function. It is re-armed when collection is switched on again.
+  __atomic_store_n(guard, 1, __ATOMIC_RELAXED);
+}
+
+void __llvm_covmap_hit_function(uint64_t functionId) {
+  HitFunction(functionId);
+}
+
+void __llvm_covmap_hit_function_once(uint64_t functionId, uint8_t *guard) {
+  uint32_t word = __atomic_load_n(&controlPage.control.word, __ATOMIC_RELAXED);
+  uint32_t generation = __atomic_load_n(&controlPage.control.generation, __ATOMIC_RELAXED);
+  if (__builtin_expect(!(word & LLVM_COVMAP_CONTROL_ENABLED) ||
+                       generation != __atomic_load_n(&armedGeneration, __ATOMIC_RELAXED), 0)) {
+    HitFunctionOnceSlow(functionId, guard);
+    return;
   }
 
+  // Once the function has been recorded, the probe does not need to call into the runtime anymore.
   SetBitmap(functionId);
+  __atomic_store_n(guard, 1, __ATOMIC_RELAXED);
+}
+
+void __llvm_covmap_register_guards(uint8_t *guards, uint64_t count) {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+
+  if (guardRangeCount == guardRangeCapacity) {
+    size_t newCapacity = guardRangeCapacity ? guardRangeCapacity * 2 : 16;
+    struct GuardRange *newRanges = (struct GuardRange *)realloc(guardRanges, newCapacity * sizeof(struct GuardRange));
+    if (!newRanges) {
+      FatalError("realloc", ENOMEM);
+    }
+    guardRanges = newRanges;
+    guardRangeCapacity = newCapacity;
+  }
+
+  guardRanges[guardRangeCount].guards = guards;
+  guardRanges[guardRangeCount].count = count;
+  ++guardRangeCount;
+
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+void __llvm_covmap_unregister_guards(uint8_t *guards) {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+
+  for (size_t i = 0; i < guardRangeCount; ++i) {
+    if (guardRanges[i].guards == guards) {
+      guardRanges[i] = guardRanges[--guardRangeCount];
+      break;
+    }
+  }
+
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
+}
+
+void __llvm_covmap_register_module(const char *moduleName, uint64_t moduleId, uint64_t functionCount,
+                                   uint64_t *moduleBase) {
+  if (pthread_mutex_lock(&mountMutex)) {
+    FatalError("pthread_mutex_lock", errno);
+  }
+
+  if (!__llvm_covmap_disabled && !__llvm_covmap) {
+    MountBitmap();
+  }
+
+  if (!__llvm_covmap_disabled && !__llvm_covmap_registry) {
+    MountRegistry();
+  }
+
+  // If the runtime is disabled, the module keeps the base of 0; its probes return right away anyway.
+  if (!__llvm_covmap_disabled) {
+    *moduleBase = RegisterModule(moduleName, moduleId, functionCount, moduleBase);
+  }
+
+  if (pthread_mutex_unlock(&mountMutex)) {
+    FatalError("pthread_mutex_unlock", errno);
+  }
 }
 
 #pragma clang diagnostic pop
\ No newline at end of file
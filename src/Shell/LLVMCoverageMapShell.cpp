@@ -2,28 +2,81 @@
 // Created by Sirui Mu on 2021/1/7.
 //
 
-#include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <climits>
+#include <csignal>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <system_error>
 #include <vector>
 
-#include <fcntl.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <cxxopts.hpp>
 
+#include "llvm-covmap/Reader/Reader.h"
+#include "llvm-covmap/Runtime/Control.h"
+#include "llvm-covmap/Runtime/ModuleRegistry.h"
+#include "llvm-covmap/Support/SharedMemory.h"
+
 namespace {
 
-struct SharedMemory {
-  int fd;
-  void *mem;
+using ReaderPtr = std::unique_ptr<llvm_covmap_reader, decltype(&llvm_covmap_reader_close)>;
+
+/**
+ * Number of covered bits at some point of a run.
+ */
+struct CoverageSample {
+  uint64_t elapsed;
+  uint64_t covered;
+};
+
+/**
+ * Telemetry of a single run of the program.
+ */
+struct RunTelemetry {
+  /**
+   * Wall clock time when the run started, in seconds since the epoch.
+   */
+  uint64_t timestamp;
+
+  /**
+   * Wall time of the run, in nanoseconds.
+   */
+  uint64_t wallTime;
+
+  rusage usage;
+  int status;
+
+  /**
+   * Samples of the merged coverage taken while the program runs, one for every change of the coverage.
+   */
+  std::vector<CoverageSample> samples;
+};
+
+/**
+ * Percentages of the final coverage whose time-to-coverage is reported.
+ */
+constexpr static const unsigned CoverageMilestones[] = { 50, 90, 99, 100 };
+
+/**
+ * Variables of the runtime that the shell controls for the program it runs.
+ */
+constexpr static const char *OverriddenEnvNames[] = {
+    "LLVM_COVMAP_SHM_NAME",
+    "LLVM_COVMAP_SHM_SIZE",
+    "LLVM_COVMAP_FORK_SLOTS",
+    "LLVM_COVMAP_OWNER",
+    "LLVM_COVMAP_SLOT",
 };
 
 __attribute__((noreturn))
@@ -32,13 +85,35 @@ void FatalError(const char *function, int errorCode) {
   abort();
 }
 
-int StartChild(const std::vector<std::string> &args, const std::string &shmemName, size_t shmemSize) noexcept {
+int StartChild(const std::vector<std::string> &args, const std::string &shmemName, size_t shmemSize,
+               size_t slots) noexcept {
+  // The parent blocks SIGCHLD to wait for the program with a timeout; the program should not inherit that.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  if (sigprocmask(SIG_UNBLOCK, &signals, nullptr) == -1) {
+    FatalError("sigprocmask", errno);
+  }
+
+  // getenv returns the first definition of a variable, so inherited definitions of the variables set below, or of the
+  // variables through which an instrumented ancestor would claim the program, must not be passed on.
   std::vector<std::string> env;
   for (auto e = environ; *e; ++e) {
-    env.emplace_back(*e);
+    auto overridden = false;
+    for (auto name : OverriddenEnvNames) {
+      auto length = strlen(name);
+      if (strncmp(*e, name, length) == 0 && (*e)[length] == '=') {
+        overridden = true;
+        break;
+      }
+    }
+    if (!overridden) {
+      env.emplace_back(*e);
+    }
   }
   env.push_back(std::string("LLVM_COVMAP_SHM_NAME=") + shmemName);
   env.push_back(std::string("LLVM_COVMAP_SHM_SIZE=") + std::to_string(shmemSize));
+  env.push_back(std::string("LLVM_COVMAP_FORK_SLOTS=") + std::to_string(slots));
 
   auto argsNative = std::make_unique<char *[]>(args.size() + 1);
   for (size_t i = 0; i < args.size(); ++i) {
@@ -57,66 +132,210 @@ int StartChild(const std::vector<std::string> &args, const std::string &shmemNam
   FatalError("execvpe", errno);
 }
 
-SharedMemory MountSharedMemory(const std::string &shmemName, size_t shmemSize) noexcept {
-  auto shmemFd = shm_open(shmemName.data(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-  if (shmemFd == -1) {
-    FatalError("shm_open", errno);
-  }
-
-  if (ftruncate64(shmemFd, shmemSize) == -1) {
-    FatalError("ftruncate64", errno);
+/**
+ * Create the coverage bitmap for the program and attach a reader to it.
+ *
+ * The bitmap is unlinked when the returned SharedMemory object is destroyed.
+ */
+std::unique_ptr<SharedMemory> MountSharedMemory(const std::string &shmemName, size_t regionSize,
+                                                size_t slots, ReaderPtr &reader) noexcept {
+  std::unique_ptr<SharedMemory> shmem;
+  try {
+    // The program might have mounted and grown the bitmap already, which is never shrunk.
+    shmem = std::make_unique<SharedMemory>(shmemName.c_str(), regionSize);
+  } catch (const std::system_error &err) {
+    FatalError("shm_open", err.code().value());
   }
 
-  auto shmem = mmap(nullptr, shmemSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmemFd, 0);
-  if (shmem == MAP_FAILED) {
-    FatalError("mmap", errno);
+  llvm_covmap_reader *rawReader;
+  auto errorCode = llvm_covmap_reader_open_shm(shmemName.c_str(), slots, &rawReader);
+  if (errorCode) {
+    FatalError("llvm_covmap_reader_open_shm", -errorCode);
   }
+  reader.reset(rawReader);
 
-  return {
-    .fd = shmemFd,
-    .mem = shmem,
-  };
+  return shmem;
 }
 
-void UnmountSharedMemory(const std::string &shmemName, SharedMemory shmem, size_t shmemSize) noexcept {
-  munmap(shmem.mem, shmemSize);
-  close(shmem.fd);
-  shm_unlink(shmemName.data());
+/**
+ * Re-map the bitmap if the program has grown it when registering modules with dense function IDs.
+ */
+void ReloadSharedMemory(llvm_covmap_reader *reader) noexcept {
+  auto errorCode = llvm_covmap_reader_reload(reader);
+  if (errorCode < 0) {
+    FatalError("llvm_covmap_reader_reload", -errorCode);
+  }
 }
 
-void DumpCoverageInfo(void *coverageBitmap, size_t shmemSize) noexcept {
-  assert(((reinterpret_cast<uintptr_t>(coverageBitmap) & 7) == 0) && "coverageBitmap is not properly aligned");
-  assert(((shmemSize & 7) == 0) && "shmemSize is not a multiple of 8");
+void UnmountSharedMemory(const std::string &shmemName, std::unique_ptr<SharedMemory> shmem,
+                         ReaderPtr reader) noexcept {
+  reader.reset();
+  shmem.reset();
+  shm_unlink((shmemName + LLVM_COVMAP_CONTROL_SUFFIX).data());
+  shm_unlink((shmemName + LLVM_COVMAP_REGISTRY_SUFFIX).data());
+}
 
+void DumpCoverageInfo(const char *title, size_t effectiveBits, size_t shmemSize) noexcept {
   size_t totalBits = shmemSize * CHAR_BIT;
-  size_t effectiveBits = 0;
-
-  auto ptr = reinterpret_cast<uint64_t *>(coverageBitmap);
-  while (shmemSize) {
-    effectiveBits += __builtin_popcountll(*ptr++);
-    shmemSize -= 8;
-  }
 
   auto ratio = static_cast<double>(effectiveBits) / totalBits;
-  std::cout << "Coverage "
+  std::cout << title << " "
       << effectiveBits << " / " << totalBits
       << " (" << ratio * 100 << "%)"
       << std::endl;
 }
 
-int StartParent(pid_t pid, const std::string &shmemName, size_t shmemSize) noexcept {
-  auto shmem = MountSharedMemory(shmemName, shmemSize);
+uint64_t ToNanoseconds(const timeval &time) noexcept {
+  return static_cast<uint64_t>(time.tv_sec) * 1000000000 + static_cast<uint64_t>(time.tv_usec) * 1000;
+}
 
-  int status;
-  do {
-    auto ret = waitpid(pid, &status, 0);
+std::string EscapeJson(const std::string &s) {
+  std::string escaped;
+  escaped.reserve(s.size());
+  for (auto ch : s) {
+    switch (ch) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(ch) < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", ch);
+          escaped += code;
+        } else {
+          escaped += ch;
+        }
+        break;
+    }
+  }
+  return escaped;
+}
+
+/**
+ * Write the telemetry of a run as a single JSON object on its own line.
+ */
+void DumpTelemetry(std::ostream &out, const std::vector<std::string> &args, const RunTelemetry &run,
+                   uint64_t covered, uint64_t total) {
+  out << "{\"timestamp\":" << run.timestamp << ",\"args\":[";
+  for (size_t i = 0; i < args.size(); ++i) {
+    out << (i ? "," : "") << "\"" << EscapeJson(args[i]) << "\"";
+  }
+  out << "]";
+
+  if (WIFEXITED(run.status)) {
+    out << ",\"exit_code\":" << WEXITSTATUS(run.status);
+  } else {
+    out << ",\"signal\":" << WTERMSIG(run.status);
+  }
+
+  out << ",\"wall_ns\":" << run.wallTime
+      << ",\"user_ns\":" << ToNanoseconds(run.usage.ru_utime)
+      << ",\"sys_ns\":" << ToNanoseconds(run.usage.ru_stime)
+      << ",\"max_rss_kb\":" << run.usage.ru_maxrss
+      << ",\"minor_faults\":" << run.usage.ru_minflt
+      << ",\"major_faults\":" << run.usage.ru_majflt
+      << ",\"voluntary_context_switches\":" << run.usage.ru_nvcsw
+      << ",\"involuntary_context_switches\":" << run.usage.ru_nivcsw
+      << ",\"covered\":" << covered
+      << ",\"total\":" << total;
+
+  // Time until the coverage first reached the given percentage of the final coverage. The 100% milestone is the time
+  // of the last new coverage; a run that goes on long after it spent the rest of its time on known code.
+  out << ",\"milestones\":{";
+  auto first = true;
+  for (auto percent : CoverageMilestones) {
+    if (covered == 0) {
+      break;
+    }
+    auto target = (covered * percent + 99) / 100;
+    for (const auto &sample : run.samples) {
+      if (sample.covered >= target) {
+        out << (first ? "" : ",") << "\"" << percent << "\":" << sample.elapsed;
+        first = false;
+        break;
+      }
+    }
+  }
+  out << "}";
+
+  out << ",\"samples\":[";
+  for (size_t i = 0; i < run.samples.size(); ++i) {
+    out << (i ? "," : "") << "[" << run.samples[i].elapsed << "," << run.samples[i].covered << "]";
+  }
+  out << "]}" << std::endl;
+}
+
+/**
+ * Wait for the given child process to terminate.
+ *
+ * If telemetry is requested, the coverage is sampled every sampleInterval milliseconds while the child runs, and the
+ * bitmap is re-mapped as the program grows it.
+ */
+void WaitForChild(pid_t pid, llvm_covmap_reader *reader, bool telemetry, unsigned sampleInterval,
+                  std::chrono::steady_clock::time_point startTime, RunTelemetry &run) noexcept {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+
+  timespec interval = {
+      .tv_sec = static_cast<time_t>(sampleInterval / 1000),
+      .tv_nsec = static_cast<long>(sampleInterval % 1000) * 1000000,
+  };
+
+  uint64_t lastCovered = 0;
+  while (true) {
+    auto ret = wait4(pid, &run.status, telemetry ? WNOHANG : 0, &run.usage);
     if (ret == -1) {
-      auto errorCode = errno;
-      UnmountSharedMemory(shmemName, shmem, shmemSize);
-      FatalError("waitpid", errorCode);
+      if (errno == EINTR) {
+        continue;
+      }
+      FatalError("wait4", errno);
+    }
+
+    if (ret == pid && (WIFEXITED(run.status) || WIFSIGNALED(run.status))) {
+      break;
     }
-  } while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
+    if (telemetry) {
+      auto elapsed = std::chrono::steady_clock::now() - startTime;
+      ReloadSharedMemory(reader);
+
+      auto covered = llvm_covmap_reader_count(reader);
+      if (covered != lastCovered) {
+        run.samples.push_back({ static_cast<uint64_t>(elapsed / std::chrono::nanoseconds(1)), covered });
+        lastCovered = covered;
+      }
+
+      // SIGCHLD is blocked, so the program terminating cuts the wait short.
+      if (sigtimedwait(&signals, nullptr, &interval) == -1 && errno != EAGAIN && errno != EINTR) {
+        FatalError("sigtimedwait", errno);
+      }
+    }
+  }
+
+  run.wallTime = (std::chrono::steady_clock::now() - startTime) / std::chrono::nanoseconds(1);
+}
+
+int StartParent(pid_t pid, const std::vector<std::string> &args, const std::string &shmemName, size_t shmemSize,
+                size_t slots, std::ofstream *telemetry, unsigned sampleInterval,
+                std::chrono::steady_clock::time_point startTime, uint64_t timestamp) noexcept {
+  ReaderPtr reader { nullptr, llvm_covmap_reader_close };
+  auto shmem = MountSharedMemory(shmemName, shmemSize * slots, slots, reader);
+
+  RunTelemetry run { };
+  run.timestamp = timestamp;
+  WaitForChild(pid, reader.get(), telemetry != nullptr, sampleInterval, startTime, run);
+
+  auto status = run.status;
   if (WIFEXITED(status)) {
     auto exitCode = WEXITSTATUS(status);
     std::cout << "Program exited normally, exit code = " << exitCode << std::endl;
@@ -125,8 +344,25 @@ int StartParent(pid_t pid, const std::string &shmemName, size_t shmemSize) noexc
     std::cout << "Program killed by signal, signal is " << sig << std::endl;
   }
 
-  DumpCoverageInfo(shmem.mem, shmemSize);
-  UnmountSharedMemory(shmemName, shmem, shmemSize);
+  ReloadSharedMemory(reader.get());
+  shmemSize = llvm_covmap_reader_size(reader.get());
+
+  auto covered = llvm_covmap_reader_count(reader.get());
+  DumpCoverageInfo("Coverage", covered, shmemSize);
+  if (slots > 1) {
+    for (size_t slot = 0; slot < slots; ++slot) {
+      auto title = "Slot " + std::to_string(slot) + " coverage";
+      DumpCoverageInfo(title.c_str(), llvm_covmap_reader_count_slot(reader.get(), slot), shmemSize);
+    }
+  }
+  UnmountSharedMemory(shmemName, std::move(shmem), std::move(reader));
+
+  if (telemetry) {
+    if (covered != (run.samples.empty() ? 0 : run.samples.back().covered)) {
+      run.samples.push_back({ run.wallTime, covered });
+    }
+    DumpTelemetry(*telemetry, args, run, covered, shmemSize * CHAR_BIT);
+  }
 
   return 0;
 }
@@ -146,6 +382,16 @@ int main(int argc, char *argv[]) {
       ("s,size", "Size of the coverage bitmap, in bytes",
           cxxopts::value<size_t>()
               ->default_value("1048576"))
+      ("slots", "Number of per-process bitmaps, one for the program and one for each forked child",
+          cxxopts::value<size_t>()
+              ->default_value("1"))
+      ("telemetry", "Append the wall time, resource usage and time-to-coverage of the run to the given file, "
+                    "as a JSON object per line",
+          cxxopts::value<std::string>())
+      ("sample-interval", "The interval between two consecutive coverage samplings while the program runs, "
+                          "in milliseconds",
+          cxxopts::value<unsigned>()
+              ->default_value("100"))
       ("args", "The arguments to the program to be run",
           cxxopts::value<std::vector<std::string>>());
   options.parse_positional("args");
@@ -164,16 +410,47 @@ int main(int argc, char *argv[]) {
   auto &programArgs = args["args"].as<std::vector<std::string>>();
   auto &name = args["name"].as<std::string>();
   auto size = args["size"].as<size_t>();
+  auto slots = args["slots"].as<size_t>();
 
   if (size & 7) {
     std::cerr << "Coverage bitmap size should be a multiple of 8" << std::endl;
     return 1;
   }
+  if (slots == 0) {
+    std::cerr << "The number of slots should be positive" << std::endl;
+    return 1;
+  }
+
+  auto sampleInterval = args["sample-interval"].as<unsigned>();
+  if (sampleInterval == 0) {
+    std::cerr << "The sample interval should be positive" << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<std::ofstream> telemetry;
+  if (args.count("telemetry")) {
+    const auto &telemetryPath = args["telemetry"].as<std::string>();
+    telemetry = std::make_unique<std::ofstream>(telemetryPath, std::ios::app);
+    if (!*telemetry) {
+      std::cerr << "Cannot open telemetry file " << telemetryPath << std::endl;
+      return 1;
+    }
+
+    // Block SIGCHLD so that the sampling loop can wait for the program with a timeout.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) == -1) {
+      FatalError("sigprocmask", errno);
+    }
+  }
 
+  auto timestamp = static_cast<uint64_t>(time(nullptr));
+  auto startTime = std::chrono::steady_clock::now();
   auto pid = fork();
   if (pid == 0) {
-    return StartChild(programArgs, name, size);
+    return StartChild(programArgs, name, size, slots);
   } else {
-    return StartParent(pid, name, size);
+    return StartParent(pid, programArgs, name, size, slots, telemetry.get(), sampleInterval, startTime, timestamp);
   }
 }
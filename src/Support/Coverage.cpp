@@ -0,0 +1,97 @@
+#include "llvm-covmap/Support/Coverage.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+typedef uint64_t CoverageVector __attribute__((vector_size(32)));
+
+} // namespace <anonymous>
+
+size_t CountCoveredBits(const void *bitmap, size_t size) noexcept {
+  assert(((reinterpret_cast<uintptr_t>(bitmap) & 7) == 0) && "bitmap is not properly aligned");
+  assert(((size & 7) == 0) && "size is not a multiple of 8");
+
+  size_t covered = 0;
+
+  auto ptr = reinterpret_cast<const uint64_t *>(bitmap);
+  while (size > 0) {
+    covered += __builtin_popcountll(*ptr++);
+    size -= 8;
+  }
+
+  return covered;
+}
+
+size_t CountCoveredBitsInRange(const void *bitmap, uint64_t begin, uint64_t end) noexcept {
+  assert(((reinterpret_cast<uintptr_t>(bitmap) & 7) == 0) && "bitmap is not properly aligned");
+
+  if (begin >= end) {
+    return 0;
+  }
+
+  auto ptr = reinterpret_cast<const uint64_t *>(bitmap);
+  auto firstWord = begin / 64;
+  auto lastWord = (end - 1) / 64;
+  auto firstMask = ~0ull << (begin % 64);
+  auto lastMask = ~0ull >> (63 - (end - 1) % 64);
+
+  if (firstWord == lastWord) {
+    return __builtin_popcountll(ptr[firstWord] & firstMask & lastMask);
+  }
+
+  size_t covered = __builtin_popcountll(ptr[firstWord] & firstMask);
+  for (auto i = firstWord + 1; i < lastWord; ++i) {
+    covered += __builtin_popcountll(ptr[i]);
+  }
+  covered += __builtin_popcountll(ptr[lastWord] & lastMask);
+
+  return covered;
+}
+
+size_t CountMergedCoveredBits(const void *bitmaps, size_t size, size_t count) noexcept {
+  assert(((reinterpret_cast<uintptr_t>(bitmaps) & 7) == 0) && "bitmaps is not properly aligned");
+  assert(((size & 7) == 0) && "size is not a multiple of 8");
+
+  size_t covered = 0;
+
+  auto words = size / 8;
+  auto base = reinterpret_cast<const uint64_t *>(bitmaps);
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t merged = 0;
+    for (size_t j = 0; j < count; ++j) {
+      merged |= base[j * words + i];
+    }
+    covered += __builtin_popcountll(merged);
+  }
+
+  return covered;
+}
+
+void MergeCoverage(void *dst, const void *src, size_t size) noexcept {
+  assert(((reinterpret_cast<uintptr_t>(dst) & 7) == 0) && "dst is not properly aligned");
+  assert(((reinterpret_cast<uintptr_t>(src) & 7) == 0) && "src is not properly aligned");
+  assert(((size & 7) == 0) && "size is not a multiple of 8");
+
+  // Bitmaps are only guaranteed to be aligned to 8 bytes, so vectors are moved with memcpy, which compiles down to
+  // unaligned vector loads and stores.
+  auto dstBytes = static_cast<uint8_t *>(dst);
+  auto srcBytes = static_cast<const uint8_t *>(src);
+  auto vectors = size / sizeof(CoverageVector);
+  for (size_t i = 0; i < vectors; ++i) {
+    CoverageVector dstVector;
+    CoverageVector srcVector;
+    std::memcpy(&dstVector, dstBytes + i * sizeof(CoverageVector), sizeof(CoverageVector));
+    std::memcpy(&srcVector, srcBytes + i * sizeof(CoverageVector), sizeof(CoverageVector));
+    dstVector |= srcVector;
+    std::memcpy(dstBytes + i * sizeof(CoverageVector), &dstVector, sizeof(CoverageVector));
+  }
+
+  auto dstWord = reinterpret_cast<uint64_t *>(dst);
+  auto srcWord = reinterpret_cast<const uint64_t *>(src);
+  for (auto i = vectors * sizeof(CoverageVector) / 8; i < size / 8; ++i) {
+    dstWord[i] |= srcWord[i];
+  }
+}
@@ -9,42 +9,103 @@
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+namespace {
+
+size_t GetObjectSize(int fd) {
+  struct stat st; // NOLINT(cppcoreguidelines-pro-type-member-init)
+  if (fstat(fd, &st) == -1) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "fstat failed" };
+  }
+  return static_cast<size_t>(st.st_size);
+}
+
+} // namespace <anonymous>
+
 SharedMemory::SharedMemory(const char *name, size_t size)
   : _name(name),
     _size(size),
     _base(nullptr),
-    _fd(0)
+    _fd(0),
+    _owner(true)
 {
   _fd = shm_open(name, O_RDWR | O_CREAT, 0666);
   if (_fd == -1) {
     throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "shm_open failed" };
   }
-  if (ftruncate(_fd, size) == -1) {
-    auto errorCode = errno;
+
+  try {
+    auto existingSize = GetObjectSize(_fd);
+    if (existingSize > size) {
+      // The instrumented program might have grown the bitmap already.
+      size = existingSize;
+    } else if (existingSize < size && ftruncate(_fd, size) == -1) {
+      throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "ftruncate failed" };
+    }
+
+    Map(size);
+  } catch (...) {
     close(_fd);
     shm_unlink(name);
-    throw std::system_error { std::make_error_code(static_cast<std::errc>(errorCode)), "ftruncate failed" };
+    throw;
+  }
+}
+
+SharedMemory::SharedMemory(const char *name)
+  : _name(name),
+    _size(0),
+    _base(nullptr),
+    _fd(0),
+    _owner(false)
+{
+  _fd = shm_open(name, O_RDONLY, 0);
+  if (_fd == -1) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "shm_open failed" };
   }
 
-  _base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
-  if (_base == MAP_FAILED) {
-    auto errorCode = errno;
+  try {
+    Map(GetObjectSize(_fd));
+  } catch (...) {
     close(_fd);
-    shm_unlink(name);
-    throw std::system_error { std::make_error_code(static_cast<std::errc>(errorCode)), "mmap failed" };
+    throw;
   }
 }
 
 SharedMemory::~SharedMemory() noexcept {
-  if (!_base || _base == MAP_FAILED) {
-    return;
+  if (_base) {
+    munmap(_base, _size);
   }
-
-  munmap(_base, _size);
   close(_fd);
-  shm_unlink(_name);
+  if (_owner) {
+    shm_unlink(_name);
+  }
 
   _base = nullptr;
 }
+
+bool SharedMemory::Reload() {
+  auto size = GetObjectSize(_fd);
+  if (size == _size) {
+    return false;
+  }
+
+  Map(size);
+  return true;
+}
+
+void SharedMemory::Map(size_t size) {
+  auto prot = _owner ? PROT_READ | PROT_WRITE : PROT_READ;
+  auto base = size ? mmap(nullptr, size, prot, MAP_SHARED, _fd, 0) : nullptr;
+  if (base == MAP_FAILED) {
+    throw std::system_error { std::make_error_code(static_cast<std::errc>(errno)), "mmap failed" };
+  }
+
+  if (_base) {
+    munmap(_base, _size);
+  }
+
+  _base = base;
+  _size = size;
+}
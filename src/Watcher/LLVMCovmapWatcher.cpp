@@ -2,6 +2,7 @@
 // Created by Sirui Mu on 2021/1/11.
 //
 
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <climits>
@@ -11,14 +12,32 @@
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <system_error>
+#include <tuple>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cxxopts.hpp>
 
+#include "llvm-covmap/Reader/Reader.h"
+#include "llvm-covmap/Runtime/Control.h"
+#include "llvm-covmap/Runtime/ModuleRegistry.h"
+#include "llvm-covmap/Support/Coverage.h"
 #include "llvm-covmap/Support/SharedMemory.h"
 
+// POSIX shared memory objects are files in this directory on Linux.
+constexpr static const char *SharedMemoryDirectory = "/dev/shm";
+
 static volatile bool Interrupted;
 static void (*PreviousInterruptHandler)(int);
 
@@ -29,6 +48,23 @@ struct CoverageRecord {
   double ratio;
 };
 
+struct ReaderDeleter {
+  void operator()(llvm_covmap_reader *reader) const noexcept {
+    llvm_covmap_reader_close(reader);
+  }
+};
+
+struct WatchedTarget {
+  std::unique_ptr<llvm_covmap_reader, ReaderDeleter> reader;
+  bool mismatchReported;
+};
+
+/**
+ * Identity of a module with dense function IDs across processes: the hash of its shared object and source file, the
+ * module ID chosen by the pass, and its function count.
+ */
+using ModuleKey = std::tuple<uint64_t, uint64_t, uint64_t>;
+
 void InterruptHandler(int sig) noexcept {
   if (sig != SIGINT) {
     return;
@@ -39,24 +75,320 @@ void InterruptHandler(int sig) noexcept {
   }
 }
 
-void CountCoverage(const SharedMemory &shm, CoverageRecord &record) noexcept {
+void AlarmHandler(int sig) noexcept {
+  if (sig != SIGALRM) {
+    return;
+  }
+  Interrupted = true;
+}
+
+void TerminateHandler(int sig) noexcept {
+  if (sig != SIGTERM && sig != SIGHUP) {
+    return;
+  }
+  Interrupted = true;
+}
+
+/**
+ * Stop watching on SIGINT, SIGTERM and SIGHUP, so that the watcher always gets to clean up, for example to switch off
+ * collection again after a burst.
+ */
+bool InstallInterruptHandlers() noexcept {
+  PreviousInterruptHandler = signal(SIGINT, InterruptHandler);
+  if (PreviousInterruptHandler == SIG_ERR ||
+      signal(SIGTERM, TerminateHandler) == SIG_ERR ||
+      signal(SIGHUP, TerminateHandler) == SIG_ERR) {
+    std::cerr << "signal failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Write the control word of the instrumented programs recording into the given bitmap.
+ *
+ * The control block is created if the programs have not started yet, so that they start in the requested state. It is
+ * never unlinked by the watcher.
+ */
+bool WriteControlWord(const std::string &controlName, uint32_t word) noexcept {
+  auto fd = shm_open(controlName.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if (fd == -1) {
+    auto errorCode = errno;
+    std::cerr << "shm_open failed: " << errorCode << ": " << strerror(errorCode) << std::endl;
+    return false;
+  }
+
+  struct stat st; // NOLINT(cppcoreguidelines-pro-type-member-init)
+  if (fstat(fd, &st) == -1 ||
+      (static_cast<size_t>(st.st_size) < sizeof(llvm_covmap_control) &&
+          ftruncate(fd, sizeof(llvm_covmap_control)) == -1)) {
+    auto errorCode = errno;
+    std::cerr << "ftruncate failed: " << errorCode << ": " << strerror(errorCode) << std::endl;
+    close(fd);
+    return false;
+  }
+
+  auto mem = mmap(nullptr, sizeof(llvm_covmap_control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    auto errorCode = errno;
+    std::cerr << "mmap failed: " << errorCode << ": " << strerror(errorCode) << std::endl;
+    return false;
+  }
+
+  // Switching collection on starts a new generation, which re-arms the one-shot probes hit while collection was off.
+  auto control = static_cast<llvm_covmap_control *>(mem);
+  if (word & LLVM_COVMAP_CONTROL_ENABLED) {
+    __atomic_add_fetch(&control->generation, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&control->word, word, __ATOMIC_RELAXED);
+  munmap(mem, sizeof(llvm_covmap_control));
+
+  return true;
+}
+
+void SetCoverage(CoverageRecord &record, uint64_t covered, uint64_t total) noexcept {
   record.timestamp = std::chrono::high_resolution_clock::now().time_since_epoch() / std::chrono::seconds(1);
-  record.covered = 0;
-  record.total = shm.size() * CHAR_BIT;
+  record.covered = covered;
+  record.total = total;
+  record.ratio = total ? static_cast<double>(covered) / static_cast<double>(total) : 0.0;
+}
+
+void DumpCoverage(const CoverageRecord &coverage, const char *scope) noexcept {
+  std::cout << coverage.timestamp << ",";
+  if (scope) {
+    std::cout << scope << ",";
+  }
+  std::cout << coverage.covered << ","
+      << coverage.total << ","
+      << coverage.ratio << std::endl;
+}
+
+void DumpModuleCoverage(const llvm_covmap_reader *reader) noexcept {
+  auto dumpModule = [](const llvm_covmap_module *module, void *context) {
+    auto reader = static_cast<const llvm_covmap_reader *>(context);
+
+    CoverageRecord coverage; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    SetCoverage(coverage, llvm_covmap_reader_count_range(reader, module->base, module->base + module->count),
+                module->count);
+
+    std::string scope { "module:" };
+    scope.append(module->name, strnlen(module->name, sizeof(module->name)));
+    DumpCoverage(coverage, scope.c_str());
+    return 0;
+  };
+  llvm_covmap_reader_foreach_module(reader, dumpModule, const_cast<llvm_covmap_reader *>(reader));
+}
+
+void WatcherLoop(llvm_covmap_reader *reader, size_t slots, bool perSlot, bool perModule, unsigned interval) noexcept {
+  if (perSlot || perModule) {
+    std::cout << "time,scope,covered,total,ratio" << std::endl;
+  } else {
+    std::cout << "time,covered,total,ratio" << std::endl;
+  }
+
+  timespec intervalTime = {
+      .tv_sec = interval,
+      .tv_nsec = 0,
+  };
+  timespec intervalRemains = intervalTime;
+
+  CoverageRecord coverage; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+  while (!Interrupted) {
+    if (nanosleep(&intervalRemains, &intervalRemains) == -1) {
+      auto errorCode = errno;
+      if (errorCode != EINTR) {
+        std::cerr << "nanosleep failed: " << errorCode << ": " << strerror(errorCode) << std::endl;
+        return;
+      }
+      if (Interrupted) {
+        break;
+      }
+      continue;
+    }
+
+    // The bitmap grows when modules with dense function IDs are loaded, and the registry is created when the first
+    // module registers itself, which might be after the watcher started.
+    auto errorCode = llvm_covmap_reader_reload(reader);
+    if (errorCode < 0) {
+      std::cerr << "Cannot reload shared memory: " << strerror(-errorCode) << std::endl;
+      return;
+    }
+
+    auto bitmapBits = llvm_covmap_reader_size(reader) * CHAR_BIT;
+
+    SetCoverage(coverage, llvm_covmap_reader_count(reader), bitmapBits);
+    DumpCoverage(coverage, perSlot || perModule ? "all" : nullptr);
+
+    if (perSlot) {
+      for (size_t slot = 0; slot < slots; ++slot) {
+        SetCoverage(coverage, llvm_covmap_reader_count_slot(reader, slot), bitmapBits);
+        DumpCoverage(coverage, ("slot:" + std::to_string(slot)).c_str());
+      }
+    }
+
+    if (perModule) {
+      DumpModuleCoverage(reader);
+    }
+
+    intervalRemains = intervalTime;
+  }
+}
+
+bool EndsWith(const std::string &s, const char *suffix) noexcept {
+  auto length = strlen(suffix);
+  return s.size() >= length && s.compare(s.size() - length, length, suffix) == 0;
+}
 
-  auto ptr = reinterpret_cast<const uint64_t *>(shm.base());
-  auto size = shm.size();
+/**
+ * Attach to the bitmaps matching the given pattern that are not watched yet, and forget the watched bitmaps that have
+ * been unlinked.
+ */
+void DiscoverTargets(const std::string &pattern, size_t slots, std::map<std::string, WatchedTarget> &targets,
+                     std::set<std::string> &attachFailures) noexcept {
+  auto dir = opendir(SharedMemoryDirectory);
+  if (!dir) {
+    auto errorCode = errno;
+    std::cerr << "opendir failed: " << errorCode << ": " << strerror(errorCode) << std::endl;
+    return;
+  }
 
-  while (size > 0) {
-    record.covered += __builtin_popcountll(*ptr++);
-    size -= 8;
+  std::set<std::string> present;
+  while (auto entry = readdir(dir)) {
+    std::string name { entry->d_name };
+    if (name.empty() || name[0] == '.' || fnmatch(pattern.c_str(), name.c_str(), 0) != 0) {
+      continue;
+    }
+    if (EndsWith(name, LLVM_COVMAP_CONTROL_SUFFIX) || EndsWith(name, LLVM_COVMAP_REGISTRY_SUFFIX)) {
+      continue;
+    }
+
+    present.insert(name);
+    if (targets.count(name)) {
+      continue;
+    }
+
+    // Attaching is retried on every sampling, since the target might still be initializing its bitmap, but the
+    // failure is only reported once.
+    llvm_covmap_reader *reader;
+    auto errorCode = llvm_covmap_reader_open_shm(name.c_str(), slots, &reader);
+    if (errorCode) {
+      if (attachFailures.insert(name).second) {
+        std::cerr << "Cannot attach to " << name << ": " << strerror(-errorCode) << std::endl;
+      }
+      continue;
+    }
+    attachFailures.erase(name);
+    targets.emplace(name, WatchedTarget { std::unique_ptr<llvm_covmap_reader, ReaderDeleter> { reader }, false });
+  }
+
+  closedir(dir);
+
+  for (auto name = attachFailures.begin(); name != attachFailures.end(); ) {
+    if (present.count(*name)) {
+      ++name;
+    } else {
+      name = attachFailures.erase(name);
+    }
   }
 
-  record.ratio = static_cast<double>(record.covered) / record.total;
+  // The coverage of targets that have exited stays in the aggregate.
+  for (auto target = targets.begin(); target != targets.end(); ) {
+    if (present.count(target->first)) {
+      ++target;
+    } else {
+      target = targets.erase(target);
+    }
+  }
 }
 
-void WatcherLoop(const SharedMemory &shm, unsigned interval) noexcept {
-  std::cout << "time,covered,total,ratio" << std::endl;
+/**
+ * Merge the coverage of a target with random function IDs into the aggregate.
+ *
+ * A function with random ID `id` is recorded in bit `id % bits` of a bitmap of `bits` bits, so the coverage of a bitmap
+ * can be folded into any smaller bitmap whose size divides its size. The aggregate takes the size of the first target
+ * and shrinks to the size of smaller targets as they show up.
+ *
+ * @return false if the size of the target and the size of the aggregate do not divide each other.
+ */
+bool MergeRandomCoverage(std::vector<uint64_t> &aggregate, const llvm_covmap_reader *reader, size_t slots) noexcept {
+  auto bitmapSize = llvm_covmap_reader_size(reader);
+  auto aggregateSize = aggregate.size() * 8;
+
+  if (aggregate.empty()) {
+    aggregate.resize(bitmapSize / 8);
+    aggregateSize = bitmapSize;
+  } else if (bitmapSize < aggregateSize) {
+    if (aggregateSize % bitmapSize != 0) {
+      return false;
+    }
+    for (size_t offset = bitmapSize; offset < aggregateSize; offset += bitmapSize) {
+      MergeCoverage(aggregate.data(), reinterpret_cast<const uint8_t *>(aggregate.data()) + offset, bitmapSize);
+    }
+    aggregate.resize(bitmapSize / 8);
+    aggregateSize = bitmapSize;
+  } else if (bitmapSize % aggregateSize != 0) {
+    return false;
+  }
+
+  for (size_t slot = 0; slot < slots; ++slot) {
+    auto bitmap = llvm_covmap_reader_bitmap(reader, slot);
+    for (size_t offset = 0; offset < bitmapSize; offset += aggregateSize) {
+      MergeCoverage(aggregate.data(), bitmap + offset, aggregateSize);
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Merge the coverage of a target with dense function IDs into the per-module aggregates.
+ *
+ * The bits assigned to a module differ between processes that do not share a registry, so the coverage of each
+ * registered module is shifted to start at bit 0 and merged with the coverage of the same module in other targets.
+ */
+void MergeModuleCoverage(std::map<ModuleKey, std::vector<uint64_t>> &modules, const llvm_covmap_reader *reader,
+                         size_t slots) noexcept {
+  struct MergeContext {
+    std::map<ModuleKey, std::vector<uint64_t>> &modules;
+    const llvm_covmap_reader *reader;
+    size_t slots;
+  } context { modules, reader, slots };
+
+  auto mergeModule = [](const llvm_covmap_module *module, void *context) {
+    auto &merge = *static_cast<MergeContext *>(context);
+    if (module->count == 0) {
+      return 0;
+    }
+
+    auto &coverage = merge.modules[ModuleKey { module->hash, module->id, module->count }];
+    coverage.resize((module->count + 63) / 64);
+
+    // The reader only visits modules that lie within the bitmap.
+    auto bitmapWords = llvm_covmap_reader_size(merge.reader) / 8;
+    for (size_t slot = 0; slot < merge.slots; ++slot) {
+      auto words = reinterpret_cast<const uint64_t *>(llvm_covmap_reader_bitmap(merge.reader, slot));
+      for (uint64_t bit = 0; bit < module->count; bit += 64) {
+        auto word = (module->base + bit) / 64;
+        auto shift = (module->base + bit) % 64;
+        auto bits = words[word] >> shift;
+        if (shift && word + 1 < bitmapWords) {
+          bits |= words[word + 1] << (64 - shift);
+        }
+        if (module->count - bit < 64) {
+          bits &= (UINT64_C(1) << (module->count - bit)) - 1;
+        }
+        coverage[bit / 64] |= bits;
+      }
+    }
+    return 0;
+  };
+  llvm_covmap_reader_foreach_module(reader, mergeModule, &context);
+}
+
+void MultiTargetWatcherLoop(const std::string &pattern, size_t slots, unsigned interval) noexcept {
+  std::cout << "time,scope,covered,total,ratio" << std::endl;
 
   timespec intervalTime = {
       .tv_sec = interval,
@@ -65,6 +397,13 @@ void WatcherLoop(const SharedMemory &shm, unsigned interval) noexcept {
   timespec intervalRemains = intervalTime;
 
   CoverageRecord coverage; // NOLINT(cppcoreguidelines-pro-type-member-init)
+  std::map<std::string, WatchedTarget> targets;
+  std::set<std::string> attachFailures;
+
+  // The union of the coverage of all targets ever seen, updated incrementally on every sampling. Targets with random
+  // function IDs are merged into a single bitmap, and targets with dense function IDs are merged module by module.
+  std::vector<uint64_t> aggregate;
+  std::map<ModuleKey, std::vector<uint64_t>> moduleAggregates;
 
   while (!Interrupted) {
     if (nanosleep(&intervalRemains, &intervalRemains) == -1) {
@@ -79,11 +418,55 @@ void WatcherLoop(const SharedMemory &shm, unsigned interval) noexcept {
       continue;
     }
 
-    CountCoverage(shm, coverage);
-    std::cout << coverage.timestamp << ","
-        << coverage.covered << ","
-        << coverage.total << ","
-        << coverage.ratio << std::endl;
+    DiscoverTargets(pattern, slots, targets, attachFailures);
+
+    for (auto &target : targets) {
+      auto reader = target.second.reader.get();
+      auto errorCode = llvm_covmap_reader_reload(reader);
+      if (errorCode < 0) {
+        std::cerr << "Cannot reload " << target.first << ": " << strerror(-errorCode) << std::endl;
+        continue;
+      }
+
+      auto bitmapSize = llvm_covmap_reader_size(reader);
+      if (bitmapSize == 0) {
+        continue;
+      }
+
+      SetCoverage(coverage, llvm_covmap_reader_count(reader), bitmapSize * 8);
+      DumpCoverage(coverage, ("target:" + target.first).c_str());
+
+      auto registry = llvm_covmap_reader_registry(reader);
+      if (registry && __atomic_load_n(&registry->count, __ATOMIC_ACQUIRE) != 0) {
+        MergeModuleCoverage(moduleAggregates, reader, slots);
+        continue;
+      }
+
+      // Nothing to merge. This also keeps a target with dense function IDs whose modules have not registered yet from
+      // resizing the aggregate.
+      if (coverage.covered == 0) {
+        continue;
+      }
+
+      if (!MergeRandomCoverage(aggregate, reader, slots)) {
+        if (!target.second.mismatchReported) {
+          std::cerr << "Bitmap size of " << target.first << " is not a multiple or a divisor of the size of other "
+              << "targets, excluded from the aggregate coverage" << std::endl;
+          target.second.mismatchReported = true;
+        }
+      }
+    }
+
+    if (!aggregate.empty() || !moduleAggregates.empty()) {
+      uint64_t covered = aggregate.empty() ? 0 : CountCoveredBits(aggregate.data(), aggregate.size() * 8);
+      uint64_t total = aggregate.size() * 64;
+      for (const auto &module : moduleAggregates) {
+        covered += CountCoveredBits(module.second.data(), module.second.size() * 8);
+        total += std::get<2>(module.first);
+      }
+      SetCoverage(coverage, covered, total);
+      DumpCoverage(coverage, "all");
+    }
 
     intervalRemains = intervalTime;
   }
@@ -100,12 +483,26 @@ int main(int argc, char **argv) {
       ("p,name", "The name of the shared bitmap memory",
           cxxopts::value<std::string>()
               ->default_value("LLVMCovmap"))
+      ("pattern", "Watch all shared bitmap memories whose names match the given shell wildcard pattern, and dump "
+                  "their aggregate coverage",
+          cxxopts::value<std::string>())
       ("s,size", "Size of the coverage bitmap, in bytes",
           cxxopts::value<size_t>()
               ->default_value("1048576"))
+      ("slots", "Number of per-process bitmaps in the shared memory, see LLVM_COVMAP_FORK_SLOTS",
+          cxxopts::value<size_t>()
+              ->default_value("1"))
+      ("per-slot", "Dump the coverage of each slot in addition to the merged coverage")
+      ("modules", "Dump the coverage of each module registered with dense function IDs")
       ("t,interval", "The interval between two consecutive coverage samplings, in seconds",
           cxxopts::value<unsigned>()
-              ->default_value("10"));
+              ->default_value("10"))
+      ("c,control", "Switch coverage collection of the instrumented programs: enable, disable, or burst, which "
+                    "enables collection, watches for --burst seconds and disables collection again",
+          cxxopts::value<std::string>())
+      ("burst", "Duration of a collection burst, in seconds",
+          cxxopts::value<unsigned>()
+              ->default_value("60"));
 
   auto args = options.parse(argc, argv);
   if (args.count("help")) {
@@ -115,28 +512,93 @@ int main(int argc, char **argv) {
 
   const auto& shmName = args["name"].as<std::string>();
   auto shmSize = args["size"].as<size_t>();
+  auto slots = args["slots"].as<size_t>();
+  auto perSlot = args.count("per-slot") != 0;
+  auto perModule = args.count("modules") != 0;
   auto interval = args["interval"].as<unsigned>();
+  auto controlName = shmName + LLVM_COVMAP_CONTROL_SUFFIX;
+
+  if (args.count("pattern")) {
+    if (args.count("control")) {
+      std::cerr << "--control cannot be used with --pattern" << std::endl;
+      return 1;
+    }
+    if (slots == 0) {
+      std::cerr << "The number of slots should be positive" << std::endl;
+      return 1;
+    }
+
+    if (!InstallInterruptHandlers()) {
+      return 1;
+    }
+
+    MultiTargetWatcherLoop(args["pattern"].as<std::string>(), slots, interval);
+    return 0;
+  }
+
+  auto burst = false;
+  if (args.count("control")) {
+    const auto &command = args["control"].as<std::string>();
+    if (command == "enable" || command == "disable") {
+      auto word = command == "enable" ? LLVM_COVMAP_CONTROL_ENABLED : 0;
+      return WriteControlWord(controlName, word) ? 0 : 1;
+    } else if (command == "burst") {
+      burst = true;
+    } else {
+      std::cerr << "Unknown control command: " << command << std::endl;
+      return 1;
+    }
+  }
 
   if (shmSize & 7) {
     std::cerr << "The size of the shared memory should be a multiple of 8" << std::endl;
     return 1;
   }
+  if (slots == 0) {
+    std::cerr << "The number of slots should be positive" << std::endl;
+    return 1;
+  }
 
+  // Attach to the bitmap of running programs without taking ownership, so that the bitmap outlives the watcher.
+  // Otherwise, create the bitmap for programs that have not started yet, and attach to it.
   std::unique_ptr<SharedMemory> shm;
-  try {
-    shm = std::make_unique<SharedMemory>(shmName.c_str(), shmSize);
-  } catch (const std::system_error &err) {
-    std::cerr << "Cannot open shared memory: " << err.what() << std::endl;
+  llvm_covmap_reader *rawReader;
+  auto errorCode = llvm_covmap_reader_open_shm(shmName.c_str(), slots, &rawReader);
+  if (errorCode == -ENOENT) {
+    try {
+      shm = std::make_unique<SharedMemory>(shmName.c_str(), shmSize * slots);
+    } catch (const std::system_error &err) {
+      std::cerr << "Cannot open shared memory: " << err.what() << std::endl;
+      return 1;
+    }
+    errorCode = llvm_covmap_reader_open_shm(shmName.c_str(), slots, &rawReader);
+  }
+  if (errorCode) {
+    std::cerr << "Cannot open shared memory: " << strerror(-errorCode) << std::endl;
     return 1;
   }
+  std::unique_ptr<llvm_covmap_reader, ReaderDeleter> reader { rawReader };
 
-  PreviousInterruptHandler = signal(SIGINT, InterruptHandler);
-  if (PreviousInterruptHandler == SIG_ERR) {
-    std::cerr << "signal failed" << std::endl;
+  if (!InstallInterruptHandlers()) {
     return 1;
   }
 
-  WatcherLoop(*shm, interval);
+  if (burst) {
+    if (signal(SIGALRM, AlarmHandler) == SIG_ERR) {
+      std::cerr << "signal failed" << std::endl;
+      return 1;
+    }
+    if (!WriteControlWord(controlName, LLVM_COVMAP_CONTROL_ENABLED)) {
+      return 1;
+    }
+    alarm(args["burst"].as<unsigned>());
+  }
+
+  WatcherLoop(reader.get(), slots, perSlot, perModule, interval);
+
+  if (burst && !WriteControlWord(controlName, 0)) {
+    return 1;
+  }
 
   return 0;
 }